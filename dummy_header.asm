@@ -39,6 +39,6 @@ JP main
 .data 0x00			# Mask ROM version number
 # CHECKSUM STOP
 
-.data 0x3F			# Header checksum (complement check)
-.data 0x00,0x00		# Checksum (ignored)
+.data 0x00			# Header checksum, filled in by the assembler
+.data 0x00,0x00		# Global checksum, filled in by the assembler
 #HEADER END
\ No newline at end of file
@@ -22,8 +22,116 @@
  * .data n: directly include the byte n at that position in the binary. n can
  * also be a list of numbers seperated by in-statement seperators or a comma.
  * .data "string": will include ascii values as constant bytes in the same way.
+ * .jumptable label, ...: jumps to the label with the index in A (up to 7F), 
+ * in constant time (48 cycles, 60 if the table crosses a 256 byte page). The
+ * dispatch code is followed by a table of the label adresses, see 
+ * put_dispatch.
+ * .vramcopy source, dest, count, budget [regs]: unrolled code that copies 
+ * count bytes from source (a label or adress) to dest, like tiles to VRAM 
+ * during VBlank. It is split in routines that take at most budget cycles 
+ * each, RET included (VBlank lasts 11D0). The first is at the named label 
+ * before, the others at NAME_1, NAME_2 and so on, to be called in the 
+ * following VBlanks. Where it is faster the bytes are read with POP, which 
+ * needs interrupts to be disabled; regs only uses LD A,(HL+). A, BC, DE and
+ * HL are changed. The routines and their cycles are listed after assembling,
+ * see put_vramcopy.
+ * .table n, expression: n bytes, the value of the expression for i from 0 to 
+ * n - 1, like .table 100, (sin(i*2*pi/100)*7F)&FF for a sine table. .tablew
+ * makes a table of words (little endian). See eval_expr. The assembler needs
+ * to be linked with the math library (-lm) for these.
  * .include "filename": will include the file specified with filename at this 
  * point before assembling.
+ * .incbin_compressed "filename", rle|lz [level]: includes the contents of a 
+ * binary file compressed, see pack_rle and pack_lz. The lz level is the 
+ * amount of earlier positions tried for each match (100 by default), lower 
+ * is faster. pgb-unpack.asm has the routines to decompress at runtime.
+ * .define NAME [n]: defines the symbol NAME with value n (1 if omitted). 
+ * Symbols can also be defined on the command line with -D NAME[=n].
+ * Additional variants of the ROM can be built in the same run with 
+ * -V outputfile:NAME[=n],... which adds the given defines to the -D ones.
+ * Source files are only loaded and lines only assembled once for all variants.
+ * Assembling goes on after an error so that all errors get reported at once,
+ * up to -E n errors (20 by default, 0 for no limit), sorted by file and line
+ * as filename:line: error: message. Instructions that cannot
+ * be assembled are replaced by zeros of about the right size.
+ * --check only looks for errors: no output file is written and no bytes are
+ * put together. The errors are printed as one JSON object per line. An input
+ * filename of - reads the source from stdin.
+ * --watch keeps running after assembling, and assembles again as soon as one
+ * of the source files changes. Only the changed files are read again.
+ * -MD writes a makefile rule listing all files read for a ROM to the output
+ * filename with .d appended, or to the file given with -MF. -MP adds an empty
+ * rule for every included file.
+ * --server socketfile stays resident and assembles on request of clients 
+ * connecting to that unix socket, keeping loaded files and encoded lines 
+ * between requests. See serve_client for the protocol.
+ * --cache dir keeps the ROMs of successful builds in dir, keyed by a hash of
+ * all files read, the defines and the assembler version. A ROM found there is
+ * used without assembling. The least recently used ROMs are removed once the 
+ * cache grows past --cache-size MiB (64 by default).
+ * The header checksum (0x14D) and global checksum (0x14E) are filled in 
+ * automatically, and the Nintendo logo at 0x104 is checked, unless 
+ * --no-header is given. Binaries smaller than a header are left alone.
+ * --update only writes the bytes of the output file that changed, --ips also
+ * writes an IPS patch from the old output file to outputfile.ips.
+ * An output filename of - writes the ROM to stdout, messages then go to 
+ * stderr. Included files that are not found as named are looked for in the 
+ * directories given with -I dir, in order.
+ * --profile file reads an execution profile of an emulator (label names with
+ * counts, or sampled PCs) and reports which routines to move to which bank
+ * to save bank switches. Code is not moved, see profile_layout.
+ * --callgraph prints every CALL, JP, JR and RST between routines with their
+ * banks, flagging calls that cross banks or go through a bank switching 
+ * trampoline in bank 0. --callgraph-json file writes the same as JSON.
+ * --run label[:setup,...[:expected,...]] calls the routine at label on a 
+ * built-in SM83 interpreter after building, until it returns, and prints the
+ * cycles it took and the registers. setup and expected are lists of REG=n, 
+ * with REG one of A, F, B, C, D, E, H, L, AF, BC, DE, HL, SP or a memory 
+ * adress in brackets like (C000), and n a number or a label. setup is done
+ * before the call, expected is checked after it. CYCLES=n in expected fails
+ * the run if it took more than n cycles. A run that does not return, or with
+ * a value that is not as expected, makes the assembler exit with status 4. 
+ * See run_routine for the machine it runs on. --run can be given many times.
+ * --probe port=n[:label,...] puts a probe after every named label that starts
+ * code (or only after the given ones), which writes the ID of the routine to
+ * adress n, and one before every RET, RET cc and RETI in it, which writes the
+ * ID to n + 1 (RET cc jumps over it when it does not return). --probe 
+ * counters[:label,...] instead adds one to a 16 bit counter of the routine in
+ * a table in WRAM (PROBE_COUNTS, placed with the variables of the 
+ * .ramsections). The IDs and labels are written to outputfile.probes. 
+ * Probes keep all registers and flags, see put_probe. Labels before 150 are 
+ * left alone, as the code there has a fixed size.
+ * .library and .endlibrary mark code that can be stripped, like the routines
+ * of an included utility library. With --strip every named label in such a
+ * section starts a block that is left out of the ROM if it is not reachable:
+ * referenced from code outside of the sections (entry point, interrupt 
+ * vectors) or from a reachable block, or run on into by reachable code. The
+ * code after it moves up, and the removed blocks are listed. Anonymous labels
+ * must not be used across blocks.
+ * --dedup leaves out blocks of .data lines after a named label that have the
+ * same bytes as an earlier block in bank 0 or in their own bank, and points 
+ * their labels to that copy. The block runs up to the first line that is not
+ * .data; .data with labels, .align and code are left alone, and so are blocks
+ * right after an unnamed label. The bytes saved are reported.
+ * .ramsection [wram] ... .endramsection declares variables: named labels, 
+ * each followed by .ds n lines that reserve n bytes for it. The assembler
+ * places them in RAM. The ones accessed most often by LD A,(nn) and LD (nn),A
+ * per byte (or by the label counts of --profile) go to HRAM at FF80, the 
+ * rest to WRAM from C000. Those accesses to HRAM are then encoded as LDH, 
+ * a byte and 4 cycles shorter. --hram n limits the bytes of HRAM used, to 
+ * leave room for the stack; wram keeps the variables of a section in WRAM.
+ * In LD A,(nn) and LD (nn),A a name like BED or CAFE is a label or variable
+ * if there is one, else a hex number.
+ * .ramsection local declares variables of the routine (named label) before 
+ * it. They are put in an overlay in WRAM, where routines that are never 
+ * active at the same time according to the call graph share their space, see
+ * place_overlay.
+ * .ifdef NAME, .ifndef NAME, .if x [op y]: conditional assembly. The lines up
+ * to the matching .else or .endif are only assembled if the condition holds.
+ * x and y are numbers or defined symbols (undefined symbols count as 0), op 
+ * is one of ==, !=, <, >, <= or >=. Without op the condition holds if x is 
+ * not 0. Blocks may be nested, but not span multiple files. Skipped lines are
+ * only scanned for nested .if/.else/.endif, so they need not be valid.
  * A comment starts with a # character, and will be ignored. Comments are the 
  * only type that are allowed after an other valid statement on the same line.
  * There are two types of labels, named labels and unnamed labels.
@@ -31,6 +139,12 @@
  * assembly labels.
  * Unnamed labels: start with a number. The assembler will attempt to align
  * the next byte to this number as adress.
+ * Local labels: start with a dot, like .loop. They belong to the named label
+ * before them and can only be referenced up to the next named label, so the
+ * same name can be used again after every named label.
+ * Anonymous labels: +:, ++:, -:, --: and so on. A reference to + jumps to the
+ * next +: label, a reference to - to the last -: label (++ and -- to the 
+ * next ++: and the last --: label).
  * TODO: parse escaped characters in a string.
  */
 
@@ -38,362 +152,6044 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <math.h>
+#ifdef __linux__
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dirent.h>
+#endif
 
 #define IN_BUFLEN	1024
-#define MAX_LABELS	1024
+#define ARENA_BLOCK	0x10000
 #define LABEL_LEN	128
 #define MAX_INSTR	5
 #define INCL_FLEN	128
+#define MAX_DEFINES	256
+#define MAX_VARIANTS	32
+#define MAX_NESTING	64
+#define MAX_ERRORS	20
+#define MAX_WATCHES	64
+#define MAX_ARGS	256
+#define MAX_INCLUDE_DIRS	16
+#define MAX_REQUEST	0x100000
+#define CACHE_SIZE	64		// MiB
+#define CACHE_VERSION	"pgb-asm " __DATE__ " " __TIME__
+#define HASH_INIT	0xcbf29ce484222325ULL
+#define LOGO_LEN	48
+#define RANGE_GAP	8		// Unchanged bytes allowed within a written range
+#define IPS_MAX_OFFSET	0xFFFFFF
+#define IPS_MAX_SIZE	0xFFFF
+#define BANK_SIZE	0x4000
+#define SWITCH_CYCLES	24		// LD A,n and LD (2000),A
+#define FAR_CALL_CYCLES	88		// CALL, RET and two bank switches
+#define MAX_LITERALS	0x7F	// Bytes copied by one control byte of .incbin_compressed
+#define RLE_MAX_RUN	0x81
+#define LZ_WINDOW	0x100
+#define LZ_MIN_MATCH	3
+#define LZ_MAX_MATCH	0x82
+#define LZ_LEVEL	0x100	// Earlier positions tried for a match by default
+#define WRAM_START	0xC000
+#define WRAM_SIZE	0x2000
+#define HRAM_START	0xFF80
+#define HRAM_SIZE	0x7F
+#define IRQ_START	0x40	// Interrupt vectors, their routines may run any time
+#define IRQ_END		0x68
+#define MAX_JUMPS	0x80	// Entries of a .jumptable, indexed by A * 2
+#define MAX_RUNS	64
+#define COPY_SP		"VRAMCOPY_SP"	// Variable to keep SP in while .vramcopy uses POP
+#define MAX_PROBES	0xFF	// Routines with probes writing their ID to a port
+#define PROBE_START	0x150	// Code before has a fixed size: RST, interrupts, header
+#define PROBE_TABLE	"PROBE_COUNTS"
+#define RUN_CYCLES	0x10000000UL	// A --run that takes longer is stopped
+#define FLAG_Z		0x80
+#define FLAG_N		0x40
+#define FLAG_H		0x20
+#define FLAG_C		0x10
+
+// Block of memory of an arena
+typedef struct arena_block
+{
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+	char data[];
+} arena_block_t;
+
+// Allocates by bumping a pointer, everything is released at once
+typedef struct
+{
+	arena_block_t *first;
+	arena_block_t *cur;
+} arena_t;
+
+// Reference to a label in the output
+typedef struct label_ref
+{
+	unsigned int pos;		// Byte position in the output
+	char relative;
+	unsigned char op;		// Opcode of the instruction, for the call graph
+	unsigned int addend;	// Added to the adress of the label
+	char number;			// Of a fixup that may be a hex number
+	char *filename;			// Where it is made, for errors
+	unsigned int line_no;
+	struct label_ref *next;
+} label_ref_t;
+
+// Instruction of interest to the call graph that does not use a label
+typedef struct
+{
+	unsigned int pos;
+	unsigned char op;		// RST opcode, or 0xEA for a write to the bank register
+} site_t;
 
 // Used for labels
 typedef struct
 {
-	char string[LABEL_LEN];
-	unsigned int points_no;
+	char *string;		// Name in the line that uses it, kept during a build
 	unsigned int pointsto;
-	fpos_t pointsfrom[MAX_LABELS];
-	char relative[MAX_LABELS];
+	label_ref_t *refs;
 	unsigned int refline;		// For undefined errors
-	char reffile[INCL_FLEN];
+	char *reffile;
 } label_t;
 
-typedef enum 
+// Labels that are resolved together: all named labels, the local labels of 
+// the current scope, or the anonymous labels
+typedef struct
+{
+	label_t *list;
+	size_t no;
+	size_t max;
+} label_table_t;
+
+// Used for .define and -D symbols
+typedef struct
+{
+	char string[LABEL_LEN];
+	long value;
+} define_t;
+
+// Kind of a source line, determined once when the file is loaded
+typedef enum
+{
+	LINE_EMPTY,		// Empty line or comment
+	LINE_INSTR,		// Mnemonic instruction
+	LINE_DATA,		// .data, .align or .table
+	LINE_ORG,		// Unnamed label, forced byte alignment
+	LINE_LABEL,		// Named label
+	LINE_INCLUDE,
+	LINE_DEFINE,
+	LINE_IF,
+	LINE_IFDEF,
+	LINE_IFNDEF,
+	LINE_ELSE,
+	LINE_ENDIF,
+	LINE_LIBRARY,
+	LINE_ENDLIBRARY,
+	LINE_INCBIN,	// .incbin_compressed
+	LINE_RAMSECTION,
+	LINE_ENDRAMSECTION,
+	LINE_DS,		// .ds n, space for a variable
+	LINE_JUMPTABLE,
+	LINE_VRAMCOPY
+} line_e;
+
+// Label reference in the bytes of an encoded line
+typedef struct
+{
+	char *string;
+	unsigned int offset;
+	char relative;
+	char number;		// Hex number to use if no label has the name
+	unsigned int label;	// Index of the label in the last build
+} fixup_t;
+
+struct source;
+
+// A line of source. Lines are encoded the first time they are assembled, 
+// after which all builds (variants) reuse the bytes and fixups.
+typedef struct
+{
+	char *str;			// Text, starting at the first non-blank character
+	line_e kind;
+	char *name;			// Label, symbol or filename, LINE_VRAMCOPY: source label
+	unsigned int label;	// LINE_LABEL: index of the label in the last build
+	unsigned int value;	// LINE_ORG: byte adress, LINE_INCBIN: 0 for rle, lz level,
+						// LINE_RAMSECTION: 1 for wram, 2 for local, LINE_DS: size
+	unsigned int skip;	// LINE_IF*, LINE_ELSE: index of matching .else/.endif
+	struct source *include;	// LINE_INCLUDE, LINE_INCBIN: the file
+	char *error;		// First error found in this line
+	int encoded;
+	unsigned char *bytes;
+	unsigned int byte_no;
+	fixup_t *fixups;
+	unsigned int fixup_no;
+} line_t;
+
+// A loaded source file, kept for the rest of the run
+typedef struct source
+{
+	char *name;
+	char *text;
+	line_t *lines;
+	unsigned int line_no;
+	arena_t arena;		// Everything the lines point to, except the text
+	int dirty;			// Changed on disk, needs to be read again
+	long mtime_sec;		// Modification time and size when last read
+	long mtime_nsec;
+	long size;
+	unsigned long long hash;	// Of the text, for the build cache
+	int binary;			// Data of .incbin_compressed, not split in lines
+	unsigned int len;	// Of the text
+	struct source *next;
+} source_t;
+
+// Compressed data of .incbin_compressed, kept for the rest of the run
+typedef struct packed
+{
+	unsigned long long key;	// Hash of the data and the compression
+	unsigned char *data;
+	unsigned int size;
+	struct packed *next;
+} packed_t;
+
+// Code from a named label up to the next one, for the profile
+typedef struct
+{
+	label_t *label;
+	unsigned int start;
+	unsigned int end;
+	unsigned int bank;
+	unsigned int new_bank;	// Suggested by the profile
+	unsigned long count;	// Executions or samples
+	unsigned int switches;	// Writes to the bank register in the routine
+} routine_t;
+
+// Code of a .library section from a named label up to the next one, which 
+// can be stripped
+typedef struct
+{
+	char *name;
+	unsigned int start;
+	unsigned int end;
+	int prev;			// Block right before it, -1 if there is none
+	int falls_in;		// The code before it runs on into it
+	int reachable;
+} block_t;
+
+// The .data lines right after a named label, which can be shared with an 
+// identical block
+typedef struct
+{
+	char *name;
+	unsigned int start;
+	unsigned int end;
+	int pinned;			// Right after an unnamed label, stays where it is
+	unsigned long long hash;	// Of the bytes
+} span_t;
+
+// Label of a duplicate data block and the label of the copy it is merged into
+typedef struct
+{
+	char *name;
+	char *target;
+	unsigned int size;
+} merge_t;
+
+// Variable of a .ramsection
+typedef struct
+{
+	char *name;
+	unsigned int size;
+	unsigned int order;		// Of declaration
+	int wram;				// Kept out of HRAM
+	char *owner;			// Routine of a local variable, NULL for a global one
+	unsigned long count;	// Accesses by LD A,(nn) and LD (nn),A, or profiled
+	unsigned int adress;
+	char *filename;			// Of the declaration, for errors
+	unsigned int line_no;
+} var_t;
+
+// Local variables of a routine, placed together in the overlay
+typedef struct
+{
+	char *owner;
+	int routine;			// Index in the routines, -1 if not found
+	unsigned int size;
+	unsigned int offset;	// In the overlay
+	char *reach;			// Routines that run while it is active
+	int irq;				// Runs from an interrupt, so at any time
+	int placed;
+} frame_t;
+
+// Routine with a --probe
+typedef struct
+{
+	char *name;
+	unsigned int pos;		// Of the adress of its counter in the output
+	char *filename;			// Of the label, for errors
+	unsigned int line_no;
+} probe_t;
+
+// Routine of a .vramcopy, for the report
+typedef struct
+{
+	char *name;
+	unsigned int dest;
+	unsigned int size;
+	unsigned long cycles;
+	unsigned long budget;
+	int stack;				// Reads with POP
+} copy_t;
+
+// Jumps or calls from one routine to another
+typedef struct
+{
+	unsigned int from;
+	unsigned int to;
+	unsigned long count;
+} edge_t;
+
+// Bytes start up to end that differ from the old output
+typedef struct
+{
+	unsigned int start;
+	unsigned int end;
+} range_t;
+
+// Error found while building
+typedef struct
+{
+	char *filename;
+	unsigned int line_no;
+	char *message;
+	unsigned int order;	// Of the errors of one line
+} diag_t;
+
+// SM83 CPU running a routine of the ROM for --run. Memory is flat: RAM and 
+// I/O registers are plain bytes, there is no PPU, timer or interrupt.
+typedef struct
+{
+	unsigned char r[8];		// B, C, D, E, H, L, F, A: F sits where the opcodes 
+							// have (HL)
+	unsigned int sp;
+	unsigned int pc;
+	int ime;
+	int halted;				// Ran into HALT or STOP
+	unsigned char *mem;		// 64 KiB, only 8000-FFFF is used
+	unsigned char *rom;
+	unsigned int rom_len;
+	unsigned int bank;		// Mapped at 4000-7FFF, set by writes to 2000-3FFF
+	unsigned long cycles;
+	unsigned long instrs;
+} cpu_t;
+
+// State of a single build of the ROM
+typedef struct
+{
+	arena_t arena;			// Everything below is allocated from it per build
+	label_table_t labels;	// Named labels
+	label_table_t locals;	// Local labels since the last named label
+	label_table_t forward;	// Anonymous + labels, only those still referenced
+	label_table_t backward;	// Anonymous - labels
+	site_t *sites;			// RST and bank switch instructions
+	unsigned int site_no;
+	unsigned int site_max;
+	block_t *blocks;		// Blocks of the .library sections, with --strip
+	unsigned int block_no;
+	unsigned int block_max;
+	int library;			// In a .library section
+	int block_open;			// In the last block
+	int falls;				// The last instruction is not a jump or return
+	int dropping;			// Dropping the lines of a stripped block
+	int strip;				// Record blocks to strip unreachable ones
+	block_t *stripped;		// Blocks left out, sorted by name (malloc'd)
+	unsigned int stripped_no;
+	span_t *spans;			// Data blocks, with --dedup
+	unsigned int span_no;
+	unsigned int span_max;
+	int span_open;			// In the last data block
+	int merging;			// Dropping the lines of a duplicate data block
+	unsigned int org;		// Adress of the last unnamed label
+	int dedup;				// Record data blocks to merge duplicates
+	merge_t *merged;		// Data blocks left out, sorted by name (malloc'd)
+	unsigned int merged_no;
+	var_t *vars;			// Variables of the .ramsections
+	unsigned int var_no;
+	unsigned int var_max;
+	int ram;				// In a .ramsection, 2 if it is wram only, 3 if local
+	char *routine;			// Last named label, owns local variables
+	int ram_var;			// Variable .ds adds to, -1 for none
+	var_t *layout;			// Variables placed in RAM, sorted by name (malloc'd)
+	unsigned int layout_no;
+	int layout_fixed;		// Placed by the last build, LD can be LDH
+	unsigned int ldh_no;	// Accesses that are (or can be) encoded as LDH
+	unsigned int overlay;	// Adress of the local variables
+	unsigned int overlay_size;
+	unsigned int overlay_unshared;	// Size if no space was shared
+	unsigned int hram_size;	// Bytes of HRAM to place variables in
+	char *profile;			// Access counts for the variables, NULL for none
+	int probe;				// Probes to put in: 1 writes IDs to probe_port, 2 counts
+	unsigned int probe_port;
+	char *probe_labels;		// Labels to probe separated by commas, NULL for all
+	probe_t *probes;		// Routines with probes, the ID is the index + 1
+	unsigned int probe_no;
+	unsigned int probe_max;
+	unsigned int probe_id;	// Of the routine being assembled, 0 if it has no probe
+	unsigned int probe_table;	// Adress of the counters
+	copy_t *copies;			// Routines of the .vramcopy lines
+	unsigned int copy_no;
+	unsigned int copy_max;
+	int copy_sp;			// COPY_SP is declared
+	define_t defines[MAX_DEFINES];
+	size_t define_no;
+	unsigned char *out;		// Assembled binary
+	unsigned int out_no;	// Amount of bytes assembled
+	unsigned int out_max;
+	diag_t *diags;
+	unsigned int diag_no;
+	unsigned int diag_max;
+	unsigned int max_errors;	// Stop after this many errors, 0 for no limit
+	int stop;
+	int check;				// Only check for errors, do not emit bytes
+	source_t **deps;		// All files read by this build
+	unsigned int dep_no;
+	unsigned int dep_max;
+	FILE *msg;				// Where messages are printed
+	char *cache_dir;		// Also keeps compressed data, NULL for none
+	char **include_dirs;	// Searched for included files (-I)
+	size_t include_dir_no;
+} build_t;
+
+// Additional ROM to build with its own set of defines (-V)
+typedef struct
+{
+	char *filename;
+	define_t *defines;	// Added to the -D defines
+	size_t define_no;
+	char *depfile;		// NULL for no dependency file
+} variant_t;
+
+// Command line options
+typedef struct
+{
+	char *in_name;
+	define_t defines[MAX_DEFINES];
+	size_t define_no;
+	variant_t variants[MAX_VARIANTS];	// The first is the main output file
+	size_t variant_no;
+	unsigned int max_errors;
+	int check;
+	int depfiles;
+	int phony;
+	int watch;
+	char *server;		// Socket to listen on, NULL when not a server
+	char *cache;		// Build cache directory, NULL for no cache
+	unsigned long cache_size;	// In bytes
+	int fix_header;		// Fill in the checksums of the header
+	int update;			// Only write the bytes of the output that changed
+	int ips;			// Write an IPS patch from the old output
+	char *include_dirs[MAX_INCLUDE_DIRS];
+	size_t include_dir_no;
+	char *profile;		// Execution profile for the layout report
+	int strip;			// Leave out unreachable blocks of .library sections
+	int dedup;			// Merge identical data blocks
+	unsigned int hram_size;	// Bytes of HRAM for .ramsection variables
+	int callgraph;		// Print the call graph
+	char *callgraph_json;	// Write the call graph as JSON to this file
+	char *runs[MAX_RUNS];	// Routines to run after building (--run)
+	size_t run_no;
+	int probe;			// 1: --probe port=n, 2: --probe counters
+	unsigned int probe_port;
+	char *probe_labels;	// Labels to probe separated by commas, NULL for all
+} options_t;
+
+typedef enum 
+{
+	ERR_NO,
+	ERR_ARG,
+	ERR_IO,
+	ERR_SYNT,
+	ERR_RUN
+	
+} error_e;
+
+error_e _err = ERR_NO;
+// Checked by the boot ROM at 0x104
+const unsigned char _logo[LOGO_LEN] = {
+	0xCE,0xED,0x66,0x66,0xCC,0x0D,0x00,0x0B,0x03,0x73,0x00,0x83,0x00,0x0C,0x00,0x0D,
+	0x00,0x08,0x11,0x1F,0x88,0x89,0x00,0x0E,0xDC,0xCC,0x6E,0xE6,0xDD,0xDD,0xD9,0x99,
+	0xBB,0xBB,0x67,0x63,0x6E,0x0E,0xEC,0xCC,0xDD,0xDC,0x99,0x9F,0xBB,0xB9,0x33,0x3E
+};
+source_t *_sources = NULL;	// All files loaded so far
+packed_t *_packed = NULL;	// Data compressed so far, with _encode_lock held
+#ifdef __linux__
+// Builds of the server share the loaded files. Changed files are only read 
+// again with _sources_lock held for writing, builds hold it for reading. 
+// Encoding lines and loading includes is done with _encode_lock held.
+pthread_rwlock_t _sources_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t _encode_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+void init_build(build_t *b);
+void free_build(build_t *b);
+void init_options(options_t *opt);
+error_e parse_options(options_t *opt, int argc, char **argv, FILE *msg);
+error_e build_all(build_t *b, source_t *src, options_t *opt);
+void set_defines(build_t *b, options_t *opt, variant_t *var);
+int strip_blocks(build_t *b);
+void print_stripped(build_t *b);
+int merge_data(build_t *b);
+void alias_merged(build_t *b);
+void place_ram(build_t *b);
+unsigned int place_overlay(build_t *b, unsigned int base);
+int is_var(build_t *b, char *name);
+routine_t *find_routines(build_t *b, unsigned int *routine_no, unsigned int **room);
+int find_routine(routine_t *r, unsigned int routine_no, unsigned int pos);
+const char *jump_kind(unsigned char op);
+void print_layout(build_t *b);
+int ldh_adress(build_t *b, line_t *line);
+void add_var(build_t *b, char *name, char *filename, unsigned int line_no);
+void begin_probe(build_t *b, source_t *src, unsigned int i);
+void put_probe(build_t *b, int exit);
+void put_exit_probe(build_t *b, line_t *line);
+void reserve_probes(build_t *b);
+void patch_probes(build_t *b);
+int write_probes(build_t *b, char *filename);
+void end_block(build_t *b);
+void end_span(build_t *b);
+void print_merged(build_t *b);
+void watch_sources(build_t *b, source_t *src, options_t *opt);
+error_e serve(char *path);
+void assemble(build_t *b, source_t *src);
+source_t *load_source(char *filename);
+source_t *load_file(char *filename, int binary);
+int read_source(source_t *src);
+void parse_file_pass1(build_t *b, source_t *src);
+void lock_encoding(int lock);
+void encode_line(source_t *src, unsigned int i);
+void put_dispatch(build_t *b, line_t *line);
+void put_vramcopy(build_t *b, source_t *src, line_t *line, unsigned int line_no);
+void print_copies(build_t *b);
+double eval_expr(char **str, long index, char **err);
+double eval_binary(char **str, long index, char **err, int level);
+double eval_unary(char **str, long index, char **err);
+void parse_instr(char *str, source_t *src, line_t *line);
+void parse_file_pass2(build_t *b);
+void patch_label(build_t *b, label_t *l);
+int patch_ref(build_t *b, unsigned int pos, char relative, unsigned int adress);
+void diag(build_t *b, char *filename, unsigned int line_no, const char *fmt, ...);
+void close_scope(build_t *b);
+void clear_diags(build_t *b);
+void reset_build(build_t *b);
+void *arena_alloc(arena_t *a, size_t n);
+void arena_reset(arena_t *a);
+void arena_free(arena_t *a);
+void *arena_grow(arena_t *a, void *ptr, size_t old, size_t n);
+char *arena_strndup(arena_t *a, const char *str, size_t len);
+char *arena_strdup(arena_t *a, const char *str);
+void sort_diags(build_t *b);
+void print_diags(build_t *b);
+void print_diags_json(build_t *b);
+int write_depfile(build_t *b, char *filename, char *target, int phony);
+unsigned long long cache_options_key(build_t *b, source_t *src, options_t *opt);
+int cache_lookup(build_t *b, unsigned long long key, options_t *opt);
+void cache_store(build_t *b, unsigned long long key, options_t *opt);
+unsigned long long hash_bytes(unsigned long long h, const void *data, size_t len);
+int fix_header(build_t *b);
+long write_output(build_t *b, char *filename, options_t *opt);
+int profile_layout(build_t *b, char *filename);
+int call_graph(build_t *b, int print, char *json_name);
+int run_routine(build_t *b, char *spec);
+unsigned char *read_binary(char *filename, unsigned int *len);
+int cache_write(char *name, void *data, size_t len);
+packed_t *pack_binary(build_t *b, source_t *bin, unsigned int level);
+define_t *set_define(define_t defines[], size_t *define_no, char *str);
+define_t *find_define(define_t defines[], size_t *define_no, char *string);
+void strtoupper(char *str);
+
+int main(int argc, char **argv)
+{
+	options_t opt;
+	build_t b;
+	size_t v;
+	
+	init_build(&b);
+	init_options(&opt);
+	_err = parse_options(&opt, argc, argv, stdout);
+	if(_err != ERR_NO)
+		goto exit;
+	
+	// Messages go to stderr when the ROM is written to stdout
+	for(v = 0; v < opt.variant_no; ++v)
+		if(opt.variants[v].filename != NULL && strcmp(opt.variants[v].filename, "-") == 0)
+			b.msg = stderr;
+	if(opt.server != NULL)
+	{
+		_err = serve(opt.server);
+		goto exit;
+	}
+	
+	// Loaded (and included) files are shared by all variants
+	source_t *src = load_source(opt.in_name);
+	if(src == NULL)
+	{
+		fprintf(b.msg, "Unable to open \'%s\'!\n", opt.in_name);
+		_err = ERR_IO;
+		goto exit;
+	}
+	
+	_err = build_all(&b, src, &opt);
+	
+	if(opt.watch)
+		watch_sources(&b, src, &opt);
+	
+exit:
+	for(v = 1; v < opt.variant_no; ++v)
+		free(opt.variants[v].defines);
+	free_build(&b);
+	return _err;
+}
+
+/**
+ * Sets up an empty build, printing its messages to stdout.
+ */
+void init_build(build_t *b)
+{
+	b->arena.first = NULL;
+	b->arena.cur = NULL;
+	b->out = NULL;
+	b->out_no = 0;
+	b->out_max = 0;
+	reset_build(b);
+	b->msg = stdout;
+	b->include_dirs = NULL;
+	b->include_dir_no = 0;
+	b->cache_dir = NULL;
+	b->strip = 0;
+	b->stripped = NULL;
+	b->stripped_no = 0;
+	b->dedup = 0;
+	b->merged = NULL;
+	b->merged_no = 0;
+	b->layout = NULL;
+	b->layout_no = 0;
+	b->layout_fixed = 0;
+	b->hram_size = HRAM_SIZE;
+	b->profile = NULL;
+	b->probe = 0;
+	b->probe_port = 0;
+	b->probe_labels = NULL;
+}
+
+void free_build(build_t *b)
+{
+	arena_free(&b->arena);
+	free(b->out);
+	free(b->stripped);
+	free(b->merged);
+	free(b->layout);
+}
+
+/**
+ * Releases everything of the last build, except for the output buffer which 
+ * is kept at its size for the next build.
+ */
+void reset_build(build_t *b)
+{
+	arena_reset(&b->arena);
+	memset(&b->labels, 0, sizeof(label_table_t));
+	memset(&b->locals, 0, sizeof(label_table_t));
+	memset(&b->forward, 0, sizeof(label_table_t));
+	memset(&b->backward, 0, sizeof(label_table_t));
+	b->sites = NULL;
+	b->site_no = 0;
+	b->site_max = 0;
+	b->blocks = NULL;
+	b->block_no = 0;
+	b->block_max = 0;
+	b->library = 0;
+	b->block_open = 0;
+	b->falls = 0;
+	b->dropping = 0;
+	b->spans = NULL;
+	b->span_no = 0;
+	b->span_max = 0;
+	b->span_open = 0;
+	b->merging = 0;
+	b->org = -1;
+	b->vars = NULL;
+	b->var_no = 0;
+	b->var_max = 0;
+	b->ram = 0;
+	b->ram_var = -1;
+	b->routine = NULL;
+	b->ldh_no = 0;
+	b->probes = NULL;
+	b->probe_no = 0;
+	b->probe_max = 0;
+	b->probe_id = 0;
+	b->probe_table = 0;
+	b->copies = NULL;
+	b->copy_no = 0;
+	b->copy_max = 0;
+	b->copy_sp = 0;
+	b->out_no = 0;
+	b->diags = NULL;
+	b->diag_no = 0;
+	b->diag_max = 0;
+	b->stop = 0;
+	b->deps = NULL;
+	b->dep_no = 0;
+	b->dep_max = 0;
+}
+
+/**
+ * Sets the options to their defaults.
+ */
+void init_options(options_t *opt)
+{
+	opt->in_name = NULL;
+	opt->define_no = 0;
+	opt->variant_no = 1;
+	opt->max_errors = MAX_ERRORS;
+	opt->check = 0;
+	opt->depfiles = 0;
+	opt->phony = 0;
+	opt->watch = 0;
+	opt->variants[0].filename = NULL;
+	opt->variants[0].defines = NULL;
+	opt->variants[0].define_no = 0;
+	opt->variants[0].depfile = NULL;
+	opt->server = NULL;
+	opt->cache = NULL;
+	opt->cache_size = CACHE_SIZE * 1024UL * 1024UL;
+	opt->fix_header = 1;
+	opt->update = 0;
+	opt->ips = 0;
+	opt->include_dir_no = 0;
+	opt->profile = NULL;
+	opt->strip = 0;
+	opt->dedup = 0;
+	opt->hram_size = HRAM_SIZE;
+	opt->callgraph = 0;
+	opt->callgraph_json = NULL;
+	opt->run_no = 0;
+	opt->probe = 0;
+	opt->probe_port = 0;
+	opt->probe_labels = NULL;
+}
+
+/**
+ * Parses the command line, messages are printed to msg.
+ */
+error_e parse_options(options_t *opt, int argc, char **argv, FILE *msg)
+{
+	int a;
+	for(a = 1; a < argc; ++a)
+	{
+		if(strncmp(argv[a], "-D", 2) == 0)
+		{
+			char *def = argv[a] + 2;
+			if(*def == 0 && a + 1 < argc)
+				def = argv[++a];
+			if(set_define(opt->defines, &opt->define_no, def) == NULL)
+			{
+				fprintf(msg, "Invalid define \'%s\'!\n", def);
+				return ERR_ARG;
+			}
+		}
+		else if(strcmp(argv[a], "--check") == 0)
+			opt->check = 1;
+		else if(strcmp(argv[a], "--watch") == 0)
+			opt->watch = 1;
+		else if(strcmp(argv[a], "--server") == 0 && a + 1 < argc)
+			opt->server = argv[++a];
+		else if(strcmp(argv[a], "--update") == 0)
+			opt->update = 1;
+		else if(strcmp(argv[a], "--ips") == 0)
+			opt->ips = 1;
+		else if(strcmp(argv[a], "--no-header") == 0)
+			opt->fix_header = 0;
+		else if(strcmp(argv[a], "--strip") == 0)
+			opt->strip = 1;
+		else if(strcmp(argv[a], "--dedup") == 0)
+			opt->dedup = 1;
+		else if(strcmp(argv[a], "--hram") == 0 && a + 1 < argc)
+		{
+			opt->hram_size = strtoul(argv[++a], NULL, 10);
+			if(opt->hram_size > HRAM_SIZE)
+				opt->hram_size = HRAM_SIZE;
+		}
+		else if(strcmp(argv[a], "--callgraph") == 0)
+			opt->callgraph = 1;
+		else if(strcmp(argv[a], "--callgraph-json") == 0 && a + 1 < argc)
+			opt->callgraph_json = argv[++a];
+		else if(strcmp(argv[a], "--run") == 0 && a + 1 < argc)
+		{
+			if(opt->run_no == MAX_RUNS)
+			{
+				fprintf(msg, "Too many routines to run, at most %d are allowed!\n", MAX_RUNS);
+				return ERR_ARG;
+			}
+			opt->runs[opt->run_no++] = argv[++a];
+		}
+		else if(strcmp(argv[a], "--probe") == 0 && a + 1 < argc)
+		{
+			// port=n[:label,...] or counters[:label,...]
+			char *mode = argv[++a];
+			char *p = strchr(mode, ':');
+			size_t len = p != NULL ? (size_t)(p - mode) : strlen(mode);
+			opt->probe_labels = p != NULL ? p + 1 : NULL;
+			if(len == 8 && strncmp(mode, "counters", 8) == 0)
+				opt->probe = 2;
+			else if(len > 5 && strncmp(mode, "port=", 5) == 0 && isxdigit(mode[5]))
+			{
+				opt->probe = 1;
+				opt->probe_port = strtoul(mode + 5, NULL, 16) & 0xFFFF;
+			}
+			else
+			{
+				fprintf(msg, "Invalid probe '%s'!\n", mode);
+				return ERR_ARG;
+			}
+		}
+		else if(strcmp(argv[a], "--profile") == 0 && a + 1 < argc)
+			opt->profile = argv[++a];
+		else if(strcmp(argv[a], "--cache") == 0 && a + 1 < argc)
+			opt->cache = argv[++a];
+		else if(strcmp(argv[a], "--cache-size") == 0 && a + 1 < argc)
+			opt->cache_size = strtoul(argv[++a], NULL, 10) * 1024UL * 1024UL;
+		else if(strncmp(argv[a], "-I", 2) == 0)
+		{
+			char *dir = argv[a] + 2;
+			if(*dir == 0 && a + 1 < argc)
+				dir = argv[++a];
+			if(opt->include_dir_no == MAX_INCLUDE_DIRS)
+			{
+				fprintf(msg, "Too many include directories, at most %d are allowed!\n", MAX_INCLUDE_DIRS);
+				return ERR_ARG;
+			}
+			opt->include_dirs[opt->include_dir_no++] = dir;
+		}
+		else if(strcmp(argv[a], "-MD") == 0)
+			opt->depfiles = 1;
+		else if(strcmp(argv[a], "-MP") == 0)
+			opt->phony = 1;
+		else if(strcmp(argv[a], "-MF") == 0 && a + 1 < argc)
+		{
+			opt->depfiles = 1;
+			opt->variants[0].depfile = argv[++a];
+		}
+		else if(strncmp(argv[a], "-E", 2) == 0)
+		{
+			char *n = argv[a] + 2;
+			if(*n == 0 && a + 1 < argc)
+				n = argv[++a];
+			opt->max_errors = strtol(n, NULL, 10);
+		}
+		else if(strncmp(argv[a], "-V", 2) == 0)
+		{
+			char *var = argv[a] + 2;
+			if(*var == 0 && a + 1 < argc)
+				var = argv[++a];
+			if(opt->variant_no == MAX_VARIANTS)
+			{
+				fprintf(msg, "Too many variants, at most %d are allowed!\n", MAX_VARIANTS);
+				return ERR_ARG;
+			}
+			// outputfile[:NAME[=n],...]
+			variant_t *v = &opt->variants[opt->variant_no++];
+			v->filename = var;
+			v->defines = (define_t*)malloc(sizeof(define_t) * MAX_DEFINES);
+			v->define_no = 0;
+			v->depfile = NULL;
+			char *p = strchr(var, ':');
+			if(p == NULL)
+				continue;
+			*p = 0;
+			// Not strtok, the server parses options in several threads
+			char *def = p+1;
+			while(def != NULL)
+			{
+				char *next = strchr(def, ',');
+				if(next != NULL)
+					*next++ = 0;
+				if(set_define(v->defines, &v->define_no, def) == NULL)
+				{
+					fprintf(msg, "Invalid define \'%s\'!\n", def);
+					return ERR_ARG;
+				}
+				def = next;
+			}
+		}
+		else if(opt->in_name == NULL)
+			opt->in_name = argv[a];
+		else if(opt->variants[0].filename == NULL)
+			opt->variants[0].filename = argv[a];
+	}
+	
+	if(opt->server != NULL)
+		return ERR_NO;
+	if(opt->in_name == NULL || (opt->variants[0].filename == NULL && !opt->check))
+	{
+		fprintf(msg, "Usage: %s [-D name[=n]]... [-I dir]... [-E maxerrors] [-MD] [-MP] "
+			   "[-MF depfile] [--watch] [--no-header] [--update] [--ips] [--strip] "
+			   "[--dedup] [--hram bytes] [--profile file] [--callgraph] [--callgraph-json file] "
+			   "[--run label[:reg=n,...[:reg=n,...]]]... [--probe port=n|counters[:label,...]] "
+			   "[--cache dir [--cache-size MiB]] <inputfile> <outputfile> "
+			   "[-V outputfile[:name[=n],...]]...\n"
+			   "       %s --check [-D name[=n]]... [-I dir]... [-E maxerrors] <inputfile> "
+			   "[-V name[:name[=n],...]]...\n"
+			   "       %s --server <socketfile>\n", argv[0], argv[0], argv[0]);
+		return ERR_ARG;
+	}
+	return ERR_NO;
+}
+
+/**
+ * Sets the defines of a build to the -D ones of the options, with the ones of
+ * a variant added.
+ */
+void set_defines(build_t *b, options_t *opt, variant_t *var)
+{
+	memcpy(b->defines, opt->defines, sizeof(define_t) * opt->define_no);
+	b->define_no = opt->define_no;
+	size_t d;
+	for(d = 0; d < var->define_no; ++d)
+	{
+		define_t *def = find_define(b->defines, &b->define_no, 
+									var->defines[d].string);
+		if(def == NULL && b->define_no < MAX_DEFINES)
+			def = &b->defines[b->define_no++];
+		if(def != NULL)
+			*def = var->defines[d];
+	}
+}
+
+/**
+ * Builds all variants from the options and writes the output files. Builds 
+ * with errors are not written, but the other variants are still built.
+ */
+error_e build_all(build_t *b, source_t *src, options_t *opt)
+{
+	error_e err = ERR_NO;
+	b->max_errors = opt->max_errors;
+	b->check = opt->check;
+	b->include_dirs = opt->include_dirs;
+	b->include_dir_no = opt->include_dir_no;
+	b->cache_dir = opt->cache;
+	b->strip = opt->strip && !opt->check;
+	b->dedup = opt->dedup && !opt->check;
+	b->hram_size = opt->hram_size;
+	b->profile = opt->profile;
+	b->probe = opt->check ? 0 : opt->probe;
+	b->probe_port = opt->probe_port;
+	b->probe_labels = opt->probe_labels;
+	
+	size_t v;
+	for(v = 0; v < opt->variant_no; ++v)
+	{
+		variant_t *var = &opt->variants[v];
+		set_defines(b, opt, var);
+		reset_build(b);
+		b->stripped_no = 0;
+		b->merged_no = 0;
+		b->layout_no = 0;
+		b->layout_fixed = 0;
+		
+		// A ROM built before from the same files and defines is reused, unless
+		// its labels are needed. The key is taken before .define lines add to
+		// the defines.
+		unsigned long long key = opt->cache != NULL ? cache_options_key(b, src, opt) : 0;
+		int cached = !b->check && opt->cache != NULL && opt->profile == NULL
+					 && !opt->callgraph && opt->callgraph_json == NULL && opt->run_no == 0
+					 && opt->probe == 0
+					 && cache_lookup(b, key, opt);
+		if(!cached)
+			assemble(b, src);
+		if(!cached && !b->check && b->diag_no == 0 
+		   && strip_blocks(b) + merge_data(b) + b->ldh_no > 0)
+		{
+			// Again without the unreachable and duplicate blocks, and with 
+			// LDH for the variables in HRAM, which moves the code after them
+			set_defines(b, opt, var);
+			reset_build(b);
+			b->layout_fixed = 1;
+			assemble(b, src);
+		}
+		
+		sort_diags(b);
+		if(b->check)
+		{
+			print_diags_json(b);
+			if(b->diag_no > 0)
+				err = ERR_SYNT;
+			continue;
+		}
+		if(b->diag_no > 0)
+		{
+			// Keep going with the other variants to report all errors
+			print_diags(b);
+			if(opt->variant_no > 1)
+				fprintf(b->msg, "%s: ", var->filename);
+			fprintf(b->msg, "Assembling failed with %u error%s.\n", b->diag_no, 
+				   b->diag_no > 1 ? "s" : "");
+			err = ERR_SYNT;
+			continue;
+		}
+		
+		// Checksums are filled in before the ROM is written or cached
+		int header = opt->fix_header && fix_header(b);
+		if(header && memcmp(b->out + 0x104, _logo, LOGO_LEN) != 0)
+		{
+			if(opt->variant_no > 1)
+				fprintf(b->msg, "%s: ", var->filename);
+			fprintf(b->msg, "warning: Nintendo logo at 0x104 does not match, the ROM will not boot!\n");
+		}
+		
+		long written = write_output(b, var->filename, opt);
+		if(written < 0)
+			return ERR_IO;
+		if(opt->cache != NULL && !cached)
+			cache_store(b, key, opt);
+		
+		// Files this ROM depends on, for make and ninja
+		if(opt->depfiles && strcmp(var->filename, "-") != 0)
+		{
+			char buf[INCL_FLEN + 2];
+			char *depfile = var->depfile;
+			if(depfile == NULL)
+			{
+				snprintf(buf, sizeof(buf), "%s.d", var->filename);
+				depfile = buf;
+			}
+			if(!write_depfile(b, depfile, var->filename, opt->phony))
+			{
+				fprintf(b->msg, "Unable to write \'%s\'!\n", depfile);
+				return ERR_IO;
+			}
+		}
+		
+		// IDs of the routines with probes
+		if(b->probe != 0 && strcmp(var->filename, "-") != 0 && !write_probes(b, var->filename))
+		{
+			fprintf(b->msg, "Unable to write '%s.probes'!\n", var->filename);
+			return ERR_IO;
+		}
+		
+		if(opt->variant_no > 1)
+			fprintf(b->msg, "%s: ", var->filename);
+		fprintf(b->msg, "Assembling completed%s.", cached ? " (cached)" : "");
+		if(header)
+			fprintf(b->msg, " Header checksum: 0x%X, global checksum: 0x%04X", 
+					b->out[0x14D], (b->out[0x14E] << 8) | b->out[0x14F]);
+		if(opt->update)
+			fprintf(b->msg, " %ld byte%s written.", written, written != 1 ? "s" : "");
+		fputc('\n', b->msg);
+		
+		if(b->stripped_no > 0)
+			print_stripped(b);
+		if(b->merged_no > 0)
+			print_merged(b);
+		if(b->layout_no > 0)
+			print_layout(b);
+		if(b->probe != 0)
+			fprintf(b->msg, "Probes: %u routine%s.\n", b->probe_no, b->probe_no != 1 ? "s" : "");
+		if(b->copy_no > 0)
+			print_copies(b);
+		if(opt->profile != NULL && !profile_layout(b, opt->profile))
+			fprintf(b->msg, "Unable to read profile \'%s\'!\n", opt->profile);
+		if((opt->callgraph || opt->callgraph_json != NULL) 
+		   && !call_graph(b, opt->callgraph, opt->callgraph_json))
+			fprintf(b->msg, "Unable to write \'%s\'!\n", opt->callgraph_json);
+		size_t r;
+		for(r = 0; r < opt->run_no; ++r)
+			if(!run_routine(b, opt->runs[r]))
+				err = ERR_RUN;
+	}
+	return err;
+}
+
+#ifdef __linux__
+/**
+ * Splits a filename in its directory and its name in that directory.
+ */
+void split_path(char *filename, char *dir, char **base)
+{
+	char *p = strrchr(filename, '/');
+	if(p == NULL)
+	{
+		strcpy(dir, ".");
+		*base = filename;
+		return;
+	}
+	if(p == filename)
+		strcpy(dir, "/");
+	else
+	{
+		strncpy(dir, filename, p - filename);
+		dir[p - filename] = 0;
+	}
+	*base = p + 1;
+}
+
+/**
+ * Stays resident after the first build, and builds again whenever one of the 
+ * loaded source files changes. Only the changed files are loaded and lexed 
+ * again, all other files keep their encoded lines. The directories of the 
+ * files are watched instead of the files themselves, as editors often save by
+ * renaming a new file over the old one.
+ */
+void watch_sources(build_t *b, source_t *src, options_t *opt)
+{
+	char dirs[MAX_WATCHES][INCL_FLEN];	// Watched directory per wd
+	int wds[MAX_WATCHES];
+	size_t dir_no = 0;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int built = 1;
+	
+	int fd = inotify_init1(IN_CLOEXEC);
+	if(fd < 0)
+	{
+		fprintf(b->msg, "Unable to watch files!\n");
+		return;
+	}
+	
+	for(;;)
+	{
+		// Includes may have been added by the last change
+		source_t *s;
+		for(s = _sources; s != NULL; s = s->next)
+		{
+			char dir[INCL_FLEN], *base;
+			size_t i;
+			if(strcmp(s->name, "-") == 0)
+				continue;
+			split_path(s->name, dir, &base);
+			for(i = 0; i < dir_no && strcmp(dirs[i], dir) != 0; ++i);
+			if(i < dir_no || dir_no == MAX_WATCHES)
+				continue;
+			wds[dir_no] = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+			if(wds[dir_no] >= 0)
+				strcpy(dirs[dir_no++], dir);
+		}
+		if(built)
+			fprintf(b->msg, "Watching for changes...\n");
+		fflush(b->msg);
+		built = 0;
+		
+		// Wait for a change, then take all events that are already queued
+		unsigned int changed = 0;
+		struct pollfd pfd = {fd, POLLIN, 0};
+		int timeout = -1;
+		while(poll(&pfd, 1, timeout) > 0)
+		{
+			ssize_t len = read(fd, buf, sizeof(buf));
+			if(len <= 0)
+				break;
+			char *p;
+			for(p = buf; p < buf + len; 
+				p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len)
+			{
+				struct inotify_event *ev = (struct inotify_event*)p;
+				size_t i;
+				for(i = 0; i < dir_no && wds[i] != ev->wd; ++i);
+				if(i == dir_no || ev->len == 0)
+					continue;
+				for(s = _sources; s != NULL; s = s->next)
+				{
+					char dir[INCL_FLEN], *base;
+					if(strcmp(s->name, "-") == 0)
+						continue;
+					split_path(s->name, dir, &base);
+					if(strcmp(dir, dirs[i]) == 0 && strcmp(base, ev->name) == 0)
+						s->dirty = 1;
+				}
+			}
+			timeout = 0;
+		}
+		
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for(s = _sources; s != NULL; s = s->next)
+		{
+			// A file that cannot be read keeps its old contents
+			if(s->dirty && read_source(s))
+				++changed;
+			s->dirty = 0;
+		}
+		if(changed == 0)
+			continue;
+		
+		build_all(b, src, opt);
+		built = 1;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		fprintf(b->msg, "Rebuilt after %u changed file%s in %.2f ms.\n", changed, 
+				changed > 1 ? "s" : "", (t1.tv_sec - t0.tv_sec) * 1000.0 
+				+ (t1.tv_nsec - t0.tv_nsec) / 1000000.0);
+	}
+}
+#else
+void watch_sources(build_t *b, source_t *src, options_t *opt)
+{
+	fprintf(b->msg, "Watching files is not supported on this platform!\n");
+}
+#endif
+
+#ifdef __linux__
+/**
+ * Reads or writes exactly len bytes on a socket. Returns 0 if the connection 
+ * was closed first.
+ */
+int recv_full(int fd, void *buf, size_t len)
+{
+	char *p = (char*)buf;
+	while(len > 0)
+	{
+		ssize_t n = recv(fd, p, len, 0);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+int send_full(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char*)buf;
+	while(len > 0)
+	{
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/**
+ * Reads the loaded files again that changed on disk since they were read.
+ * Builds still running keep the old lines until they are done.
+ */
+void refresh_sources(void)
+{
+	source_t *s;
+	int changed = 0;
+	struct stat st;
+	
+	// Builds add included files to the list with _encode_lock held
+	pthread_rwlock_rdlock(&_sources_lock);
+	lock_encoding(1);
+	for(s = _sources; s != NULL; s = s->next)
+	{
+		if(strcmp(s->name, "-") == 0 || stat(s->name, &st) != 0)
+			continue;
+		s->dirty = st.st_mtim.tv_sec != s->mtime_sec 
+				   || st.st_mtim.tv_nsec != s->mtime_nsec 
+				   || st.st_size != s->size;
+		changed |= s->dirty;
+	}
+	lock_encoding(0);
+	pthread_rwlock_unlock(&_sources_lock);
+	if(!changed)
+		return;
+	
+	pthread_rwlock_wrlock(&_sources_lock);
+	for(s = _sources; s != NULL; s = s->next)
+	{
+		if(s->dirty)
+			read_source(s);
+		s->dirty = 0;
+	}
+	pthread_rwlock_unlock(&_sources_lock);
+}
+
+/**
+ * Runs one request of a client. argv[0] is the command: assemble or check 
+ * take the same arguments as the command line, symbol takes the arguments of 
+ * check followed by the name of a label or define to look up.
+ */
+error_e serve_request(build_t *b, int argc, char **argv)
+{
+	options_t opt;
+	char *symbol = NULL;
+	error_e err;
+	size_t v;
+	
+	init_options(&opt);
+	if(strcmp(argv[0], "symbol") == 0 && argc > 2)
+	{
+		symbol = argv[--argc];
+		opt.check = 1;
+	}
+	else if(strcmp(argv[0], "check") == 0)
+		opt.check = 1;
+	else if(strcmp(argv[0], "assemble") != 0)
+	{
+		fprintf(b->msg, "Unknown request \'%s\'!\n", argv[0]);
+		return ERR_ARG;
+	}
+	
+	err = parse_options(&opt, argc, argv, b->msg);
+	if(err == ERR_NO && (opt.watch || opt.server != NULL 
+						 || strcmp(opt.in_name, "-") == 0))
+	{
+		fprintf(b->msg, "Not supported by the server!\n");
+		err = ERR_ARG;
+	}
+	if(err != ERR_NO)
+		goto exit;
+	
+	refresh_sources();
+	pthread_rwlock_rdlock(&_sources_lock);
+	lock_encoding(1);
+	source_t *src = load_source(opt.in_name);
+	lock_encoding(0);
+	if(src == NULL)
+	{
+		fprintf(b->msg, "Unable to open \'%s\'!\n", opt.in_name);
+		err = ERR_IO;
+	}
+	else
+		err = build_all(b, src, &opt);
+	
+	// Looked up in the last variant, labels before defines. Label names point
+	// into the loaded files, so the lock is still needed.
+	if(src != NULL && symbol != NULL)
+	{
+		char *name = symbol;
+		size_t i;
+		strtoupper(name);
+		for(i = 0; i < b->labels.no && strcmp(b->labels.list[i].string, name) != 0; ++i);
+		define_t *d = find_define(b->defines, &b->define_no, name);
+		if(i < b->labels.no && b->labels.list[i].pointsto != (unsigned int)-1)
+			fprintf(b->msg, "%s = 0x%X\n", name, b->labels.list[i].pointsto);
+		else if(d != NULL)
+			fprintf(b->msg, "%s = 0x%lX\n", name, d->value);
+		else
+		{
+			fprintf(b->msg, "Symbol \'%s\' not found!\n", name);
+			err = ERR_ARG;
+		}
+	}
+	pthread_rwlock_unlock(&_sources_lock);
+	
+exit:
+	for(v = 1; v < opt.variant_no; ++v)
+		free(opt.variants[v].defines);
+	return err;
+}
+
+/**
+ * Serves the requests of one client until it disconnects. Every request and 
+ * response is a 4 byte big endian length followed by that many bytes. A 
+ * request holds the arguments, each ended by a 0 byte. The response is the 
+ * exit status as a decimal number and a newline, followed by all messages 
+ * that the command line would have printed.
+ */
+void *serve_client(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	unsigned char head[4];
+	build_t b;
+	
+	init_build(&b);
+	while(recv_full(fd, head, 4))
+	{
+		uint32_t len = ((uint32_t)head[0] << 24) | (head[1] << 16) 
+					   | (head[2] << 8) | head[3];
+		if(len == 0 || len > MAX_REQUEST)
+			break;
+		char *req = (char*)malloc(len + 1);
+		if(!recv_full(fd, req, len))
+		{
+			free(req);
+			break;
+		}
+		req[len] = 0;
+		
+		char *argv[MAX_ARGS];
+		int argc = 0;
+		char *p;
+		for(p = req; p < req + len && argc < MAX_ARGS; p += strlen(p) + 1)
+			argv[argc++] = p;
+		
+		char *text = NULL;
+		size_t text_len = 0;
+		b.msg = open_memstream(&text, &text_len);
+		error_e err = serve_request(&b, argc, argv);
+		fclose(b.msg);
+		free(req);
+		
+		char status[16];
+		int status_len = snprintf(status, sizeof(status), "%d\n", err);
+		len = status_len + text_len;
+		head[0] = len >> 24;
+		head[1] = len >> 16;
+		head[2] = len >> 8;
+		head[3] = len;
+		int sent = send_full(fd, head, 4) && send_full(fd, status, status_len)
+				   && send_full(fd, text, text_len);
+		free(text);
+		if(!sent)
+			break;
+	}
+	close(fd);
+	free_build(&b);
+	return NULL;
+}
+
+/**
+ * Stays resident and assembles on request of clients connecting to a unix 
+ * socket at path. Loaded files and their encoded lines are kept between 
+ * requests, files are only read again when they have changed on disk. 
+ * Every client gets its own thread, so requests may run at the same time.
+ * Filenames are relative to the working directory of the server.
+ */
+error_e serve(char *path)
+{
+	struct sockaddr_un addr;
+	
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		printf("Socket filename \'%s\' is too long!\n", path);
+		return ERR_ARG;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+	{
+		printf("Unable to create socket!\n");
+		return ERR_IO;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	
+	// A socket left by a server that did not exit cleanly, any other file is
+	// left alone
+	struct stat st;
+	if(lstat(path, &st) == 0)
+	{
+		if(!S_ISSOCK(st.st_mode))
+		{
+			printf("\'%s\' exists and is not a socket!\n", path);
+			close(fd);
+			return ERR_ARG;
+		}
+		unlink(path);
+	}
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0)
+	{
+		printf("Unable to listen on \'%s\'!\n", path);
+		close(fd);
+		return ERR_IO;
+	}
+	printf("Listening on \'%s\'...\n", path);
+	fflush(stdout);
+	
+	for(;;)
+	{
+		int c = accept(fd, NULL, NULL);
+		if(c < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, serve_client, (void*)(intptr_t)c) != 0)
+		{
+			close(c);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	close(fd);
+	return ERR_IO;
+}
+#else
+error_e serve(char *path)
+{
+	printf("The server is not supported on this platform!\n");
+	return ERR_ARG;
+}
+#endif
+
+void assemble(build_t *b, source_t *src)
+{
+	// First pass, leaves in labels
+	parse_file_pass1(b, src);
+	if(b->stop)
+		return;
+	end_block(b);
+	end_span(b);
+	close_scope(b);
+	alias_merged(b);
+	reserve_probes(b);
+	place_ram(b);
+	patch_probes(b);
+	size_t i;
+	for(i = 0; i < b->forward.no && !b->stop; ++i)
+		if(b->forward.list[i].refs != NULL)
+			diag(b, b->forward.list[i].reffile, b->forward.list[i].refline, 
+				 "No anonymous label \'%s\' after this reference!", b->forward.list[i].string);
+	if(b->stop)
+		return;
+	
+	// Second pass, fixes labels
+	parse_file_pass2(b);
+}
+
+/**
+ * Allocates n bytes from an arena. Blocks kept by arena_reset are used again
+ * before new ones are allocated.
+ */
+void *arena_alloc(arena_t *a, size_t n)
+{
+	n = (n + 7) & ~(size_t)7;
+	arena_block_t *blk = a->cur;
+	while(blk != NULL && blk->used + n > blk->size)
+		blk = blk->next;
+	if(blk == NULL)
+	{
+		size_t size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+		blk = (arena_block_t*)malloc(sizeof(arena_block_t) + size);
+		blk->size = size;
+		blk->used = 0;
+		blk->next = NULL;
+		// Appended after the last block, blocks stay in the order they are used
+		arena_block_t **p = (a->cur != NULL) ? &a->cur->next : &a->first;
+		while(*p != NULL)
+			p = &(*p)->next;
+		*p = blk;
+	}
+	a->cur = blk;
+	void *ptr = blk->data + blk->used;
+	blk->used += n;
+	return ptr;
+}
+
+/**
+ * Grows an allocation of an arena from old to n bytes, like realloc. The last
+ * allocation is grown in place when possible.
+ */
+void *arena_grow(arena_t *a, void *ptr, size_t old, size_t n)
+{
+	size_t old_al = (old + 7) & ~(size_t)7, n_al = (n + 7) & ~(size_t)7;
+	arena_block_t *blk = a->cur;
+	if(ptr != NULL && blk != NULL && (char*)ptr + old_al == blk->data + blk->used
+	   && blk->used - old_al + n_al <= blk->size)
+	{
+		blk->used = blk->used - old_al + n_al;
+		return ptr;
+	}
+	void *p = arena_alloc(a, n);
+	if(ptr != NULL)
+		memcpy(p, ptr, old < n ? old : n);
+	return p;
+}
+
+char *arena_strndup(arena_t *a, const char *str, size_t len)
+{
+	char *p = (char*)arena_alloc(a, len + 1);
+	memcpy(p, str, len);
+	p[len] = 0;
+	return p;
+}
+
+char *arena_strdup(arena_t *a, const char *str)
+{
+	return arena_strndup(a, str, strlen(str));
+}
+
+/**
+ * Releases everything allocated from an arena at once, the blocks are kept.
+ */
+void arena_reset(arena_t *a)
+{
+	arena_block_t *blk;
+	for(blk = a->first; blk != NULL; blk = blk->next)
+		blk->used = 0;
+	a->cur = a->first;
+}
+
+void arena_free(arena_t *a)
+{
+	while(a->first != NULL)
+	{
+		arena_block_t *next = a->first->next;
+		free(a->first);
+		a->first = next;
+	}
+	a->cur = NULL;
+}
+
+/**
+ * Records an error of a build, print_diags prints them when it is done. The 
+ * build is stopped once the maximum amount of errors has been reached.
+ */
+void diag(build_t *b, char *filename, unsigned int line_no, const char *fmt, ...)
+{
+	char buf[IN_BUFLEN];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buf, IN_BUFLEN, fmt, args);
+	va_end(args);
+	
+	if(b->diag_no == b->diag_max)
+	{
+		b->diag_max = b->diag_max ? b->diag_max * 2 : 16;
+		b->diags = (diag_t*)arena_grow(&b->arena, b->diags, sizeof(diag_t) * b->diag_no,
+									   sizeof(diag_t) * b->diag_max);
+	}
+	diag_t *d = &b->diags[b->diag_no++];
+	d->filename = arena_strdup(&b->arena, filename);
+	d->line_no = line_no;
+	d->message = arena_strdup(&b->arena, buf);
+	d->order = b->diag_no;
+	if(b->max_errors != 0 && b->diag_no >= b->max_errors)
+		b->stop = 1;
+}
+
+/**
+ * Compares errors by file and line, then in the order they were found.
+ */
+int cmp_diag(const void *a, const void *b)
+{
+	const diag_t *x = (const diag_t*)a, *y = (const diag_t*)b;
+	int c = strcmp(x->filename, y->filename);
+	if(c != 0)
+		return c;
+	if(x->line_no != y->line_no)
+		return x->line_no < y->line_no ? -1 : 1;
+	return x->order < y->order ? -1 : (x->order > y->order);
+}
+
+/**
+ * Sorts the errors of a build by file and line, the passes find them out of 
+ * order.
+ */
+void sort_diags(build_t *b)
+{
+	qsort(b->diags, b->diag_no, sizeof(diag_t), cmp_diag);
+}
+
+/**
+ * Prints the errors of a build as filename:line: error: message.
+ */
+void print_diags(build_t *b)
+{
+	unsigned int i;
+	for(i = 0; i < b->diag_no; ++i)
+		fprintf(b->msg, "%s:%u: error: %s\n", b->diags[i].filename, b->diags[i].line_no, 
+				b->diags[i].message);
+	if(b->stop)
+		fprintf(b->msg, "Too many errors, stopping.\n");
+}
+
+/**
+ * Prints a string as JSON string constant.
+ */
+void print_json_string(FILE *f, const char *str)
+{
+	fputc('\"', f);
+	for(; *str; ++str)
+	{
+		if(*str == '\"' || *str == '\\')
+			fprintf(f, "\\%c", *str);
+		else if((unsigned char)*str < 0x20)
+			fprintf(f, "\\u%04x", *str);
+		else
+			fputc(*str, f);
+	}
+	fputc('\"', f);
+}
+
+/**
+ * Prints the errors of a build for tools, as one JSON object per line:
+ * {"file":"name","line":n,"severity":"error","message":"text"}
+ */
+void print_diags_json(build_t *b)
+{
+	unsigned int i;
+	for(i = 0; i < b->diag_no; ++i)
+	{
+		fprintf(b->msg, "{\"file\":");
+		print_json_string(b->msg, b->diags[i].filename);
+		fprintf(b->msg, ",\"line\":%u,\"severity\":\"error\",\"message\":", b->diags[i].line_no);
+		print_json_string(b->msg, b->diags[i].message);
+		fprintf(b->msg, "}\n");
+	}
+}
+
+/**
+ * Removes all errors of a build, their memory is released with the arena.
+ */
+void clear_diags(build_t *b)
+{
+	b->diags = NULL;
+	b->diag_no = 0;
+	b->diag_max = 0;
+	b->stop = 0;
+}
+
+/**
+ * Stores an error for a line, it gets reported by every build that assembles 
+ * the line. Only the first error of a line is kept.
+ */
+void line_error(source_t *src, line_t *line, const char *fmt, ...)
+{
+	char buf[IN_BUFLEN];
+	va_list args;
+	if(line->error != NULL)
+		return;
+	va_start(args, fmt);
+	vsnprintf(buf, IN_BUFLEN, fmt, args);
+	va_end(args);
+	line->error = arena_strdup(&src->arena, buf);
+}
+
+/**
+ * Converts a C-string to full upper case.
+ */
+void strtoupper(char *str)
+{
+	size_t i;
+	for(i = 0; i < strlen(str); ++i)
+		str[i] = toupper(str[i]);
+}
+
+/**
+ * Find a certain label in a table of a build. If not found, adds it to the end
+ * of the table and returns that element. The name is not copied, it must stay
+ * valid for the rest of the build.
+ */
+label_t *find_label(build_t *b, label_table_t *t, char *string)
+{
+	size_t i;
+	for(i = 0; i < t->no; ++i)
+		if(strcmp(t->list[i].string, string) == 0)
+			return &t->list[i];
+	
+	if(t->no == t->max)
+	{
+		t->max = t->max ? t->max * 2 : 16;
+		t->list = (label_t*)arena_grow(&b->arena, t->list, sizeof(label_t) * t->no,
+									   sizeof(label_t) * t->max);
+	}
+	label_t *l = &t->list[t->no++];
+	l->string = string;
+	l->pointsto = -1;
+	l->refs = NULL;
+	l->refline = -1;
+	l->reffile = NULL;
+	return l;
+}
+
+/**
+ * Find a label of a build for a line or fixup. Builds add their labels in the
+ * same order most of the time, so the index found in the last build (hint) is
+ * tried first.
+ */
+label_t *find_label_hint(build_t *b, char *string, unsigned int *hint)
+{
+	// The hint is shared by the builds of the server, only as a guess
+	unsigned int h = __atomic_load_n(hint, __ATOMIC_RELAXED);
+	if(h < b->labels.no && strcmp(b->labels.list[h].string, string) == 0)
+		return &b->labels.list[h];
+	label_t *l = find_label(b, &b->labels, string);
+	__atomic_store_n(hint, (unsigned int)(l - b->labels.list), __ATOMIC_RELAXED);
+	return l;
+}
+
+/**
+ * Reads a symbol name at *str, skipping leading whitespace. The name is copied
+ * to buf in upper case and *str is moved past it. Returns the length.
+ */
+size_t read_symbol(char **str, char *buf)
+{
+	size_t len = 0;
+	while(**str == ' ' || **str == '\t')
+		++*str;
+	while((isalnum(**str) || **str == '_') && len < LABEL_LEN-1)
+	{
+		buf[len++] = toupper(**str);
+		++*str;
+	}
+	buf[len] = 0;
+	return len;
+}
+
+/**
+ * Find a define by name, returns NULL if it is not defined.
+ */
+define_t *find_define(define_t defines[], size_t *define_no, char *string)
+{
+	size_t i;
+	for(i = 0; i < *define_no; ++i)
+		if(strcmp(defines[i].string, string) == 0)
+			return &defines[i];
+	return NULL;
+}
+
+/**
+ * Defines a symbol from a string of the form NAME[=n] or NAME [n]. Redefining
+ * an existing symbol changes its value. Returns NULL on a malformed string or
+ * if there is no room left.
+ */
+define_t *set_define(define_t defines[], size_t *define_no, char *str)
+{
+	char buf[LABEL_LEN];
+	if(read_symbol(&str, buf) == 0 || isdigit(*buf))
+		return NULL;
+	
+	define_t *d = find_define(defines, define_no, buf);
+	if(d == NULL)
+	{
+		if(*define_no == MAX_DEFINES)
+			return NULL;
+		d = &defines[(*define_no)++];
+		strcpy(d->string, buf);
+	}
+	
+	while(*str == ' ' || *str == '\t' || *str == '=')
+		++str;
+	d->value = isdigit(*str) ? strtol(str, NULL, 16) : 1;
+	return d;
+}
+
+/**
+ * Reads one operand of an .if condition: a number or a symbol.
+ */
+long read_operand(char **str, define_t defines[], size_t *define_no)
+{
+	char buf[LABEL_LEN];
+	while(**str == ' ' || **str == '\t')
+		++*str;
+	if(isdigit(**str))
+		return strtol(*str, str, 16);
+	
+	read_symbol(str, buf);
+	define_t *d = find_define(defines, define_no, buf);
+	return d != NULL ? d->value : 0;
+}
+
+/**
+ * Evaluates the condition of an .if statement, x [op y]. Returns 1 if it holds,
+ * 0 if it does not and -1 if it is malformed.
+ */
+int eval_condition(char *str, define_t defines[], size_t *define_no)
+{
+	long x = read_operand(&str, defines, define_no);
+	while(*str == ' ' || *str == '\t')
+		++str;
+	if(*str == '#' || *str == 0)
+		return x != 0;
+	
+	char op[3] = {0, 0, 0};
+	op[0] = *str++;
+	if(*str == '=')
+		op[1] = *str++;
+	long y = read_operand(&str, defines, define_no);
+	
+	if(strcmp(op, "==") == 0)	return x == y;
+	if(strcmp(op, "!=") == 0)	return x != y;
+	if(strcmp(op, "<=") == 0)	return x <= y;
+	if(strcmp(op, ">=") == 0)	return x >= y;
+	if(strcmp(op, "<") == 0)	return x < y;
+	if(strcmp(op, ">") == 0)	return x > y;
+	return -1;
+}
+
+/**
+ * Checks if a line starts with a directive, as a whole word so that local
+ * labels like .data_end: are not taken for one.
+ */
+int is_directive(char *str, char *name)
+{
+	size_t len = strlen(name);
+	return strncmp(str, name, len) == 0 && !isalnum(str[len]) 
+	       && str[len] != '_' && str[len] != ':';
+}
+
+/**
+ * Determines the kind of a source line, and stores what can be known about it 
+ * without assembling it (label names, included filenames).
+ */
+void lex_line(source_t *src, unsigned int i)
+{
+	line_t *line = &src->lines[i];
+	char *str = line->str;
+	
+	// Comment or empty line
+	if(*str == '#' || *str == 0)
+	{
+		line->kind = LINE_EMPTY;
+		return;
+	}
+	// Conditional assembly
+	if(is_directive(str, ".ifdef") || is_directive(str, ".ifndef"))
+	{
+		char buf[LABEL_LEN];
+		char *p = str + ((str[3] == 'n') ? 7 : 6);
+		line->kind = (str[3] == 'n') ? LINE_IFNDEF : LINE_IFDEF;
+		if(read_symbol(&p, buf) == 0)
+			line_error(src, line, "Syntax error, symbol expected near %s", str);
+		line->name = arena_strdup(&src->arena, buf);
+		return;
+	}
+	if(is_directive(str, ".if"))
+	{
+		line->kind = LINE_IF;
+		return;
+	}
+	if(is_directive(str, ".else"))
+	{
+		line->kind = LINE_ELSE;
+		return;
+	}
+	if(is_directive(str, ".endif"))
+	{
+		line->kind = LINE_ENDIF;
+		return;
+	}
+	if(is_directive(str, ".define"))
+	{
+		line->kind = LINE_DEFINE;
+		return;
+	}
+	if(is_directive(str, ".ramsection"))
+	{
+		char buf[LABEL_LEN];
+		char *p = str + 11;
+		read_symbol(&p, buf);
+		line->kind = LINE_RAMSECTION;
+		line->value = strcmp(buf, "WRAM") == 0 ? 1 : strcmp(buf, "LOCAL") == 0 ? 2 : 0;
+		return;
+	}
+	if(is_directive(str, ".endramsection"))
+	{
+		line->kind = LINE_ENDRAMSECTION;
+		return;
+	}
+	if(is_directive(str, ".ds"))
+	{
+		line->kind = LINE_DS;
+		line->value = strtol(str + 3, NULL, 16);
+		return;
+	}
+	if(is_directive(str, ".jumptable"))
+	{
+		line->kind = LINE_JUMPTABLE;
+		return;
+	}
+	// .vramcopy source, dest, count, budget [regs], the rest may use defines
+	if(is_directive(str, ".vramcopy"))
+	{
+		char buf[LABEL_LEN];
+		char *p = str + 9;
+		line->kind = LINE_VRAMCOPY;
+		while(*p == ' ' || *p == '\t')
+			++p;
+		if(isdigit(*p))
+			return;
+		if(read_symbol(&p, buf) == 0)
+			line_error(src, line, "Syntax error, label or adress expected near %s", str);
+		line->name = arena_strdup(&src->arena, buf);
+		return;
+	}
+	if(is_directive(str, ".library"))
+	{
+		line->kind = LINE_LIBRARY;
+		return;
+	}
+	if(is_directive(str, ".endlibrary"))
+	{
+		line->kind = LINE_ENDLIBRARY;
+		return;
+	}
+	// .incbin_compressed "file", rle|lz [level]
+	if(is_directive(str, ".incbin_compressed"))
+	{
+		char *p1 = strchr(str, '\"');
+		char *p2 = strrchr(str, '\"');
+		if(p1 == NULL || p1 == p2)
+		{
+			line_error(src, line, "Syntax error: \" expected near %s!", str);
+			line->kind = LINE_EMPTY;
+			return;
+		}
+		line->kind = LINE_INCBIN;
+		line->name = arena_strndup(&src->arena, p1+1, p2-p1-1);
+		char buf[LABEL_LEN];
+		char *p = p2 + 1 + strspn(p2 + 1, " \t,");
+		read_symbol(&p, buf);
+		p += strspn(p, " \t,");
+		if(strcmp(buf, "RLE") == 0)
+			line->value = 0;
+		else if(strcmp(buf, "LZ") == 0)
+		{
+			line->value = (*p && *p != '#') ? strtol(p, NULL, 16) : LZ_LEVEL;
+			if(line->value == 0)
+				line->value = 1;
+		}
+		else
+		{
+			line_error(src, line, "Syntax error, rle or lz expected near %s", str);
+			line->kind = LINE_EMPTY;
+		}
+		return;
+	}
+	// .include file
+	if(is_directive(str, ".include"))
+	{
+		char *p1 = strchr(str, '\"');
+		char *p2 = strrchr(str, '\"');
+		if(p1 == NULL || p1 == p2)
+		{
+			line_error(src, line, "Syntax error: \" expected near %s!", str);
+			line->kind = LINE_EMPTY;
+			return;
+		}
+		line->kind = LINE_INCLUDE;
+		line->name = arena_strndup(&src->arena, p1+1, p2-p1-1);
+		return;
+	}
+	// .data, .align and .table are encoded when assembled
+	if(is_directive(str, ".data") || is_directive(str, ".align") 
+	   || is_directive(str, ".table") || is_directive(str, ".tablew"))
+	{
+		line->kind = LINE_DATA;
+		return;
+	}
+	// Labels
+	size_t llen = strcspn(str, ":");
+	if(llen != strlen(str))
+	{
+		// label that starts with a digit must be a forced byte alignment.
+		if(isdigit(*str))
+		{
+			line->kind = LINE_ORG;
+			line->value = strtol(str, NULL, 16);
+			return;
+		}
+		
+		// otherwise treat as normal label.
+		line->kind = LINE_LABEL;
+		line->name = arena_strndup(&src->arena, str, llen);
+		strtoupper(line->name);
+		return;
+	}
+	
+	line->kind = LINE_INSTR;
+}
+
+/**
+ * Loads a source file, or returns it from the list of loaded files. Returns 
+ * NULL if the file cannot be opened.
+ */
+source_t *load_source(char *filename)
+{
+	return load_file(filename, 0);
+}
+
+/**
+ * Loads a source file, or a binary file that is not split in lines.
+ */
+source_t *load_file(char *filename, int binary)
+{
+	source_t *src;
+	for(src = _sources; src != NULL; src = src->next)
+		if(strcmp(src->name, filename) == 0 && src->binary == binary)
+			return src;
+	
+	src = (source_t*)calloc(1, sizeof(source_t));
+	src->name = strdup(filename);
+	src->binary = binary;
+	if(!read_source(src))
+	{
+		free(src->name);
+		free(src);
+		return NULL;
+	}
+	
+	src->next = _sources;
+	_sources = src;
+	return src;
+}
+
+/**
+ * Frees the lines of a source file and everything they point to. The blocks 
+ * of the arena are kept for reading the file again.
+ */
+void free_lines(source_t *src)
+{
+	arena_reset(&src->arena);
+	free(src->text);
+	src->lines = NULL;
+	src->text = NULL;
+	src->line_no = 0;
+}
+
+/**
+ * Reads (or reads again) the contents of a source file. The file is split in 
+ * lines and every line gets lexed, .if blocks are matched up so that builds 
+ * can jump over blocks that are not assembled. Returns 0 if the file cannot be
+ * opened, the old contents are kept in that case.
+ */
+int read_source(source_t *src)
+{
+	// - reads from stdin, e.g. an unsaved buffer of an editor
+	FILE *input = (strcmp(src->name, "-") == 0) ? stdin : fopen(src->name, "rb");
+	if(input == NULL)
+		return 0;
+	
+	size_t len = 0, max = IN_BUFLEN;
+	char *text = (char*)malloc(max + 1);
+	size_t n;
+	while((n = fread(text + len, 1, max - len, input)) > 0)
+	{
+		len += n;
+		if(len == max)
+		{
+			max *= 2;
+			text = (char*)realloc(text, max + 1);
+		}
+	}
+#ifdef __linux__
+	struct stat st;
+	if(fstat(fileno(input), &st) == 0)
+	{
+		src->mtime_sec = st.st_mtim.tv_sec;
+		src->mtime_nsec = st.st_mtim.tv_nsec;
+		src->size = st.st_size;
+	}
+#endif
+	if(input != stdin)
+		fclose(input);
+	text[len] = 0;
+	
+	free_lines(src);
+	src->text = text;
+	src->len = len;
+	src->hash = hash_bytes(HASH_INIT, text, len);
+	if(src->binary)
+		return 1;
+	
+	size_t i;
+	for(i = 0; i < len; ++i)
+		if(text[i] == '\n')
+			src->line_no++;
+	if(len > 0 && text[len-1] != '\n')
+		src->line_no++;
+	src->lines = (line_t*)arena_alloc(&src->arena, (src->line_no + 1) * sizeof(line_t));
+	memset(src->lines, 0, (src->line_no + 1) * sizeof(line_t));
+	
+	// Split in lines, blanks at the start and line endings are cut off
+	char *p = text;
+	unsigned int l;
+	for(l = 0; l < src->line_no; ++l)
+	{
+		char *end = strchr(p, '\n');
+		if(end != NULL)
+			*end = 0;
+		if(end != NULL && end > p && end[-1] == '\r')
+			end[-1] = 0;
+		while(*p == ' ' || *p == '\t')
+			++p;
+		src->lines[l].str = p;
+		p = (end != NULL) ? end + 1 : p + strlen(p);
+	}
+	
+	unsigned int open[MAX_NESTING];	// .if/.else lines of the open blocks
+	unsigned int depth = 0;
+	for(l = 0; l < src->line_no; ++l)
+	{
+		line_t *line = &src->lines[l];
+		lex_line(src, l);
+		switch(line->kind)
+		{
+			case LINE_IF:
+			case LINE_IFDEF:
+			case LINE_IFNDEF:
+				if(depth == MAX_NESTING)
+				{
+					line_error(src, line, "Too many nested .if blocks!");
+					line->kind = LINE_EMPTY;
+					break;
+				}
+				open[depth++] = l;
+				break;
+			case LINE_ELSE:
+			case LINE_ENDIF:
+				if(depth == 0)
+				{
+					line_error(src, line, "Syntax error, %s without .if",
+							   line->kind == LINE_ELSE ? ".else" : ".endif");
+					line->kind = LINE_EMPTY;
+					break;
+				}
+				src->lines[open[depth-1]].skip = l;
+				if(src->lines[l].kind == LINE_ELSE)
+					open[depth-1] = l;
+				else
+					--depth;
+				break;
+			default:
+				break;
+		}
+	}
+	// Blocks that are not closed run up to the end of the file
+	while(depth > 0)
+	{
+		line_t *line = &src->lines[open[--depth]];
+		line_error(src, line, "Syntax error, .endif expected before end of file");
+		line->skip = src->line_no - 1;
+	}
+	
+	return 1;
+}
+
+/**
+ * Appends a byte to the encoding of a line.
+ */
+void line_put(source_t *src, line_t *line, int c)
+{
+	if(line->byte_no % 16 == 0)
+		line->bytes = (unsigned char*)arena_grow(&src->arena, line->bytes, 
+												 line->byte_no, line->byte_no + 16);
+	line->bytes[line->byte_no++] = c;
+}
+
+/**
+ * Records a label reference at the current end of the encoding of a line.
+ */
+void line_fixup(source_t *src, line_t *line, char *string, char relative)
+{
+	if(line->fixup_no % 4 == 0)
+		line->fixups = (fixup_t*)arena_grow(&src->arena, line->fixups, 
+											sizeof(fixup_t) * line->fixup_no,
+											sizeof(fixup_t) * (line->fixup_no + 4));
+	fixup_t *f = &line->fixups[line->fixup_no++];
+	f->string = arena_strdup(&src->arena, string);
+	f->offset = line->byte_no;
+	f->relative = relative;
+	f->number = 0;
+	f->label = -1;
+}
+
+/**
+ * Guesses the size of an instruction that could not be assembled from its
+ * operands, so the adresses after it stay close to right while the rest of the
+ * errors get collected.
+ */
+unsigned int guess_size(char *str)
+{
+	char in_buf[IN_BUFLEN];
+	char *instr[MAX_INSTR];
+	unsigned int instr_n = 0;
+	const char *regs[] = {"A", "B", "C", "D", "E", "H", "L", "AF", "BC", "DE",
+						  "HL", "SP", "NZ", "Z", "NC", "(HL)", "(BC)", "(DE)", 
+						  "(C)", "(HL+)", "(HL-)", "(HLI)", "(HLD)", "SP+", "+", 
+						  NULL};
+	
+	strncpy(in_buf, str, IN_BUFLEN-1);
+	in_buf[IN_BUFLEN-1] = 0;
+	strtoupper(in_buf);
+	char *pch = strtok(in_buf, ", \t");
+	while(pch != NULL && *pch != '#' && instr_n < MAX_INSTR)
+	{
+		instr[instr_n++] = pch;
+		pch = strtok(NULL, ", \t");
+	}
+	if(instr_n == 0)
+		return 0;
+	
+	// CB prefixed instructions never have immediate operands
+	const char *cb[] = {"RLC", "RL", "RRC", "RR", "SLA", "SRA", "SRL", "SWAP",
+						"BIT", "RES", "SET", NULL};
+	unsigned int i, j;
+	for(i = 0; cb[i] != NULL; ++i)
+		if(strcmp(instr[0], cb[i]) == 0)
+			return 2;
+	
+	// Add the size of the first immediate operand
+	for(i = 1; i < instr_n; ++i)
+	{
+		for(j = 0; regs[j] != NULL; ++j)
+			if(strcmp(instr[i], regs[j]) == 0)
+				break;
+		if(regs[j] != NULL)
+			continue;
+		
+		if(strcmp(instr[0], "JR") == 0 || strcmp(instr[0], "LDH") == 0
+		   || strchr(instr[i], '+') != NULL)
+			return 2;
+		if(*instr[i] == '(' || strcmp(instr[0], "CALL") == 0 
+		   || strcmp(instr[0], "JP") == 0)
+			return 3;
+		if(strcmp(instr[0], "LD") == 0 && (strcmp(instr[1], "BC") == 0 
+		   || strcmp(instr[1], "DE") == 0 || strcmp(instr[1], "HL") == 0 
+		   || strcmp(instr[1], "SP") == 0))
+			return 3;
+		return 2;
+	}
+	return 1;
+}
+
+/**
+ * Takes (lock != 0) or releases the lock for changing loaded files during a 
+ * build, only needed when the server runs builds at the same time.
+ */
+void lock_encoding(int lock)
+{
+#ifdef __linux__
+	if(lock)
+		pthread_mutex_lock(&_encode_lock);
+	else
+		pthread_mutex_unlock(&_encode_lock);
+#endif
+}
+
+/**
+ * Evaluates an expression of .table at *str for entry index, moving *str past
+ * it. Numbers are hexadecimal, i is the index and pi the constant. There are 
+ * the functions sin, cos, tan, atan, sqrt, pow, exp, log, abs, floor, ceil, 
+ * round, min and max, and the operators of C from | to unary - and ~. /
+ * divides without rounding, the bit operators work on the integer part. On 
+ * an error *err is set to where it was found.
+ */
+double eval_expr(char **str, long index, char **err)
+{
+	return eval_binary(str, index, err, 0);
+}
+
+// Binary operators from the lowest precedence up
+static const char *_operators[] = {"|", "^", "&", "<< >>", "+ -", "* / %", NULL};
+
+/**
+ * Evaluates the binary operators of a precedence level and higher.
+ */
+double eval_binary(char **str, long index, char **err, int level)
+{
+	if(_operators[level] == NULL)
+		return eval_unary(str, index, err);
+	double x = eval_binary(str, index, err, level + 1);
+	while(*err == NULL)
+	{
+		*str += strspn(*str, " \t");
+		char op = **str;
+		// Operators of this level, << and >> are written twice
+		const char *ops = _operators[level];
+		if(op == 0 || strchr(ops, op) == NULL || op == ' ')
+			break;
+		if(op == '<' || op == '>')
+		{
+			if((*str)[1] != op)
+				break;
+			++*str;
+		}
+		++*str;
+		double y = eval_binary(str, index, err, level + 1);
+		switch(op)
+		{
+			case '|':	x = (double)((long)x | (long)y);	break;
+			case '^':	x = (double)((long)x ^ (long)y);	break;
+			case '&':	x = (double)((long)x & (long)y);	break;
+			case '<':	x = (double)((long)x << (long)y);	break;
+			case '>':	x = (double)((long)x >> (long)y);	break;
+			case '+':	x += y;	break;
+			case '-':	x -= y;	break;
+			case '*':	x *= y;	break;
+			case '/':	x = (y != 0) ? x / y : 0;	break;
+			case '%':	x = ((long)y != 0) ? (double)((long)x % (long)y) : 0;	break;
+		}
+	}
+	return x;
+}
+
+/**
+ * Evaluates a number, i, pi, a function call or an expression in brackets, 
+ * with any unary - and ~ before it.
+ */
+double eval_unary(char **str, long index, char **err)
+{
+	*str += strspn(*str, " \t");
+	char *start = *str;
+	if(**str == '-' || **str == '~' || **str == '+')
+	{
+		char op = *(*str)++;
+		double x = eval_unary(str, index, err);
+		return op == '-' ? -x : op == '~' ? (double)~(long)x : x;
+	}
+	if(**str == '(')
+	{
+		++*str;
+		double x = eval_expr(str, index, err);
+		*str += strspn(*str, " \t");
+		if(**str != ')' && *err == NULL)
+			*err = *str;
+		++*str;
+		return x;
+	}
+	
+	char name[LABEL_LEN];
+	size_t len = 0;
+	while((isalnum(**str) || **str == '_') && len < LABEL_LEN - 1)
+		name[len++] = toupper(*(*str)++);
+	name[len] = 0;
+	if(len == 0)
+	{
+		*err = start;
+		return 0;
+	}
+	if(strcmp(name, "I") == 0)
+		return index;
+	if(strcmp(name, "PI") == 0)
+		return M_PI;
+	
+	static const char *functions[] = {"SIN", "COS", "TAN", "ATAN", "SQRT", "EXP", "LOG", 
+									  "ABS", "FLOOR", "CEIL", "ROUND", "POW", "MIN", "MAX", NULL};
+	int f;
+	for(f = 0; functions[f] != NULL && strcmp(functions[f], name) != 0; ++f);
+	if(functions[f] == NULL)
+	{
+		// Hexadecimal number, with or without 0x
+		char *end;
+		long n = strtol(start, &end, 16);
+		if(end != *str)
+			*err = start;
+		return n;
+	}
+	
+	*str += strspn(*str, " \t");
+	if(**str != '(')
+	{
+		*err = *str;
+		return 0;
+	}
+	++*str;
+	double x = eval_expr(str, index, err), y = 0;
+	*str += strspn(*str, " \t");
+	if(f >= 11)	// Two arguments
+	{
+		if(**str != ',')
+		{
+			if(*err == NULL)
+				*err = *str;
+			return 0;
+		}
+		++*str;
+		y = eval_expr(str, index, err);
+		*str += strspn(*str, " \t");
+	}
+	if(**str != ')' && *err == NULL)
+		*err = *str;
+	++*str;
+	switch(f)
+	{
+		case 0:	return sin(x);
+		case 1:	return cos(x);
+		case 2:	return tan(x);
+		case 3:	return atan(x);
+		case 4:	return sqrt(x);
+		case 5:	return exp(x);
+		case 6:	return log(x);
+		case 7:	return fabs(x);
+		case 8:	return floor(x);
+		case 9:	return ceil(x);
+		case 10:	return round(x);
+		case 11:	return pow(x, y);
+		case 12:	return x < y ? x : y;
+		default:	return x > y ? x : y;
+	}
+}
+
+/**
+ * Assembles a line of the LINE_INSTR or LINE_DATA kind to bytecode. Labels are
+ * left as fixups, which are resolved for each build.
+ */
+void encode_line(source_t *src, unsigned int i)
+{
+	line_t *line = &src->lines[i];
+	size_t str_pos = 0;
+	
+	// Tokens are cut out of a copy, lines can be of any length
+	char *in_buf = arena_strdup(&src->arena, line->str);
+	
+	if(line->kind == LINE_INSTR)
+	{
+		parse_instr(in_buf, src, line);
+		if(line->error != NULL)
+		{
+			// Fill in zeros so the adresses after it stay about right
+			unsigned int size = guess_size(line->str);
+			line->fixup_no = 0;
+			line->byte_no = 0;
+			while(size-- > 0)
+				line_put(src, line, 0x00);
+		}
+		return;
+	}
+	
+	// .data segment, parse rest as block of data seperated by ','
+	if(strstr(in_buf, ".data") == in_buf)
+	{
+		str_pos += 5;
+		while(in_buf[str_pos] == ' ' || in_buf[str_pos] == '\t')
+			++str_pos;
+		
+		if(in_buf[str_pos] == '#' || in_buf[str_pos] == 0)	// ignore comments
+			return;
+		
+		if(in_buf[str_pos] == '\"')	// string
+		{
+			++str_pos;
+			while(in_buf[str_pos] != '\"' && in_buf[str_pos])
+			{
+				line_put(src, line, in_buf[str_pos]);
+				++str_pos;
+			}
+			return;
+		}
+		else if(isdigit(in_buf[str_pos]))	// constant block
+		{			
+			char *pch = strtok(in_buf+str_pos, ", \t");
+			while(pch != NULL)
+			{
+				if(*pch == '#')	// ignore comments
+					break;
+				
+				long i = strtol(pch, NULL, 16);
+				line_put(src, line, (int)i);
+				pch = strtok(NULL, ", \t");
+			}
+			return;
+		}
+		line_error(src, line, "Syntax error, number constant or string expected near %s", in_buf + str_pos);
+		return;
+	}
+	// .jumptable label, ...: the adresses, the dispatch code is put before 
+	// them when assembled
+	if(line->kind == LINE_JUMPTABLE)
+	{
+		strtoupper(in_buf);
+		char *pch = strtok(in_buf + 10, ", \t");
+		while(pch != NULL && *pch != '#')
+		{
+			long adress = 0;
+			if(isdigit(*pch))
+				adress = strtol(pch, NULL, 16);
+			else
+				line_fixup(src, line, pch, 0);
+			line_put(src, line, adress & 0xFF);
+			line_put(src, line, (adress >> 8) & 0xFF);
+			pch = strtok(NULL, ", \t");
+		}
+		if(line->byte_no == 0)
+			line_error(src, line, "Syntax error, labels expected near %s", line->str);
+		else if(line->byte_no > 2 * MAX_JUMPS)
+			line_error(src, line, "Too many entries in a jump table, at most %d are allowed!", MAX_JUMPS);
+		return;
+	}
+	// .table n, expression and .tablew n, expression
+	if(strstr(in_buf, ".table") == in_buf)
+	{
+		int words = in_buf[6] == 'w' || in_buf[6] == 'W';
+		char *p = in_buf + (words ? 7 : 6);
+		char *end;
+		long n = strtol(p, &end, 16);
+		if(end == p || n < 0)
+		{
+			line_error(src, line, "Syntax error, number of entries expected near %s", p);
+			return;
+		}
+		p = end + strspn(end, " \t");
+		if(*p == ',')
+			++p;
+		long i;
+		for(i = 0; i < n; ++i)
+		{
+			char *err = NULL;
+			char *q = p;
+			double v = eval_expr(&q, i, &err);
+			q += strspn(q, " \t");
+			if(err == NULL && *q != 0 && *q != '#')
+				err = q;
+			if(err != NULL)
+			{
+				line_error(src, line, "Syntax error in expression near %s", err);
+				return;
+			}
+			long x = (long)v;
+			line_put(src, line, (int)(x & 0xFF));
+			if(words)
+				line_put(src, line, (int)((x >> 8) & 0xFF));
+		}
+		return;
+	}
+	// .align n: fill with n zeros.
+	str_pos += 6;
+	while(in_buf[str_pos] == ' ' || in_buf[str_pos] == '\t')
+		++str_pos;
+	if(isdigit(in_buf[str_pos]))
+	{
+		long i = strtol(in_buf + str_pos, NULL, 16);
+		line->bytes = (unsigned char*)arena_alloc(&src->arena, i);
+		memset(line->bytes, 0, i);
+		line->byte_no = i;
+		return;
+	}
+	line_error(src, line, "Syntax error, number constant expected near %s", in_buf + str_pos);
+}
+
+/**
+ * Makes room for n more bytes in the output of a build.
+ */
+void out_reserve(build_t *b, unsigned int n)
+{
+	if(b->out_no + n <= b->out_max)
+		return;
+	while(b->out_no + n > b->out_max)
+		b->out_max = b->out_max ? b->out_max * 2 : 0x8000;
+	b->out = (unsigned char*)realloc(b->out, b->out_max);
+}
+
+/**
+ * Adds a file to the files read by a build, if it is not in there yet.
+ */
+void add_dep(build_t *b, source_t *src)
+{
+	unsigned int i;
+	for(i = 0; i < b->dep_no && b->deps[i] != src; ++i);
+	if(i < b->dep_no)
+		return;
+	if(b->dep_no == b->dep_max)
+	{
+		b->dep_max = b->dep_max ? b->dep_max * 2 : 16;
+		b->deps = (source_t**)arena_grow(&b->arena, b->deps, sizeof(source_t*) * b->dep_no,
+										 sizeof(source_t*) * b->dep_max);
+	}
+	b->deps[b->dep_no++] = src;
+}
+
+/**
+ * Resolves the local labels of the scope that ends here, at the next named 
+ * label or the end of the program. The table is emptied for the next scope.
+ */
+void close_scope(build_t *b)
+{
+	size_t i;
+	for(i = 0; i < b->locals.no && !b->stop; ++i)
+	{
+		label_t *l = &b->locals.list[i];
+		if(l->pointsto == (unsigned int)-1)
+			diag(b, l->reffile, l->refline, "Undefined local label \'%s\' referenced!", l->string);
+		else
+			patch_label(b, l);
+	}
+	b->locals.no = 0;
+}
+
+/**
+ * Defines the label of a line at the current adress. A named label starts a
+ * new scope for local (.name) labels. An anonymous + label resolves all the
+ * references to it made so far, - labels are kept for later references.
+ */
+void define_label(build_t *b, line_t *line)
+{
+	label_t *l;
+	switch(*line->name)
+	{
+		case '.':
+			find_label(b, &b->locals, line->name)->pointsto = b->out_no;
+			break;
+		case '+':
+			l = find_label(b, &b->forward, line->name);
+			l->pointsto = b->out_no;
+			patch_label(b, l);
+			l->refs = NULL;
+			l->refline = -1;
+			break;
+		case '-':
+			find_label(b, &b->backward, line->name)->pointsto = b->out_no;
+			break;
+		default:
+			close_scope(b);
+			find_label_hint(b, line->name, &line->label)->pointsto = b->out_no;
+			break;
+	}
+}
+
+/**
+ * Tells if an encoded instruction is an RST, or a write of A to the bank 
+ * register of the cartridge (LD (2000-3FFF),A).
+ */
+int is_site(line_t *line)
+{
+	if(line->byte_no == 1 && (line->bytes[0] & 0xC7) == 0xC7)
+		return 1;
+	return line->byte_no == 3 && line->fixup_no == 0 && line->bytes[0] == 0xEA
+		   && line->bytes[2] >= 0x20 && line->bytes[2] < 0x40;
+}
+
+/**
+ * Puts the dispatch code of a .jumptable in the output, right before its 
+ * table. It jumps to the entry with index A, changing A and HL, in 48 cycles
+ * when the table does not cross a 256 byte page (align it with an unnamed 
+ * label to make sure), else in 60 as JR NC over INC H takes 12 cycles either
+ * way.
+ */
+void put_dispatch(build_t *b, line_t *line)
+{
+	// LD HL,table; ADD A,A; ADD A,L; LD L,A; [JR NC,+1; INC H;] 
+	// LD A,(HL+); LD H,(HL); LD L,A; JP (HL)
+	static const unsigned char page[] = {0x21, 0x00, 0x00, 0x87, 0x85, 0x6F, 
+										 0x2A, 0x66, 0x6F, 0xE9};
+	static const unsigned char any[] = {0x21, 0x00, 0x00, 0x87, 0x85, 0x6F, 0x30, 0x01, 0x24,
+										0x2A, 0x66, 0x6F, 0xE9};
+	const unsigned char *stub = page;
+	unsigned int n = sizeof(page);
+	unsigned int table = b->out_no + n;
+	if((table >> 8) != ((table + line->byte_no - 1) >> 8))
+	{
+		stub = any;
+		n = sizeof(any);
+		table = b->out_no + n;
+	}
+	if(!b->check)
+	{
+		out_reserve(b, n);
+		memcpy(b->out + b->out_no, stub, n);
+		b->out[b->out_no+1] = table & 0xFF;
+		b->out[b->out_no+2] = (table >> 8) & 0xFF;
+	}
+	b->out_no += n;
+}
+
+/**
+ * Puts a byte in the output.
+ */
+void out_byte(build_t *b, unsigned char c)
+{
+	if(!b->check)
+	{
+		out_reserve(b, 1);
+		b->out[b->out_no] = c;
+	}
+	b->out_no++;
+}
+
+/**
+ * Puts a 16 bit adress in the output, the one of label name plus addend if 
+ * name is not NULL.
+ */
+void out_adress(build_t *b, char *name, unsigned int adress, unsigned char op,
+				char *filename, unsigned int line_no)
+{
+	if(name != NULL)
+	{
+		label_t *l = find_label(b, &b->labels, name);
+		label_ref_t *r = (label_ref_t*)arena_alloc(&b->arena, sizeof(label_ref_t));
+		r->pos = b->out_no;
+		r->relative = 0;
+		r->op = op;
+		r->addend = adress;
+		r->number = 0;
+		r->filename = filename;
+		r->line_no = line_no;
+		r->next = l->refs;
+		l->refs = r;
+		if(l->refline == (unsigned int)-1)
+		{
+			l->refline = line_no;
+			l->reffile = filename;
+		}
+		adress = 0;
+	}
+	out_byte(b, adress & 0xFF);
+	out_byte(b, (adress >> 8) & 0xFF);
+}
+
+/**
+ * Tells how many of n bytes a .vramcopy routine copies to dest within budget
+ * cycles, and sets *cycles to the cycles it takes. With registers that is 40 
+ * (LD HL,source; LD DE,dest; RET) and 20 per byte (LD A,(HL+); LD (DE),A; 
+ * INC E). From the stack it is 100 (saving, setting and restoring SP, 
+ * LD HL,dest; RET) and 36 per 2 bytes (POP BC; LD (HL),C; INC L; LD (HL),B;
+ * INC L). After the last byte of a 256 byte page INC DE or INC HL takes 4 
+ * cycles more, the increment after the last byte is left out.
+ */
+unsigned int vramcopy_fit(int stack, unsigned int dest, unsigned int n, unsigned long budget,
+						  unsigned long *cycles)
+{
+	unsigned int k;
+	*cycles = stack ? 100 : 40;
+	for(k = 0; k < n; ++k)
+	{
+		unsigned long c = stack ? ((k & 1) ? 8 : 20) : 16;
+		if(k > 0)
+			c += ((dest + k - 1) & 0xFF) == 0xFF ? 8 : 4;
+		if(*cycles + c > budget)
+			break;
+		*cycles += c;
+	}
+	return k;
+}
+
+/**
+ * Puts the routines of a .vramcopy line in the output. Each copies as many 
+ * of the bytes left as fit in the budget, reading them with POP if that gets
+ * more done (and the line does not say regs), see vramcopy_fit. SP is kept 
+ * in the WRAM variable COPY_SP meanwhile.
+ */
+void put_vramcopy(build_t *b, source_t *src, line_t *line, unsigned int line_no)
+{
+	char buf[LABEL_LEN];
+	char *p = line->str + 9;
+	unsigned int source = 0, done = 0, chunk = 0, i;
+	long dest, count, budget;
+	
+	while(*p == ' ' || *p == '\t')
+		++p;
+	if(line->name == NULL)
+		source = strtol(p, &p, 16);
+	else
+		read_symbol(&p, buf);
+	while(*p == ' ' || *p == '\t' || *p == ',')
+		++p;
+	dest = read_operand(&p, b->defines, &b->define_no);
+	while(*p == ' ' || *p == '\t' || *p == ',')
+		++p;
+	count = read_operand(&p, b->defines, &b->define_no);
+	while(*p == ' ' || *p == '\t' || *p == ',')
+		++p;
+	budget = read_operand(&p, b->defines, &b->define_no);
+	read_symbol(&p, buf);
+	int regs = strcmp(buf, "REGS") == 0;
+	if(count <= 0 || budget <= 0 || dest < 0 || dest > 0xFFFF || (*buf != 0 && !regs))
+	{
+		diag(b, src->name, line_no, "Syntax error, .vramcopy source, dest, count, budget [regs] "
+			 "expected near %s", line->str);
+		return;
+	}
+	if(b->routine == NULL)
+	{
+		diag(b, src->name, line_no, "Named label expected before .vramcopy");
+		return;
+	}
+	
+	while(done < count)
+	{
+		unsigned int d = dest + done, n, k;
+		unsigned long cycles, stack_cycles;
+		n = vramcopy_fit(0, d, count - done, budget, &cycles);
+		k = regs ? 0 : vramcopy_fit(1, d, count - done, budget, &stack_cycles);
+		int stack = k > n || (k == n && k > 0 && stack_cycles < cycles);
+		if(stack)
+		{
+			n = k;
+			cycles = stack_cycles;
+		}
+		if(n == 0)
+		{
+			diag(b, src->name, line_no, "A budget of 0x%lX cycles is too small for .vramcopy", budget);
+			return;
+		}
+		
+		// The first routine is at the label before, the others get one
+		char *name = b->routine;
+		if(chunk > 0)
+		{
+			snprintf(buf, sizeof(buf), "%s_%u", b->routine, chunk);
+			name = arena_strdup(&b->arena, buf);
+			find_label(b, &b->labels, name)->pointsto = b->out_no;
+		}
+		chunk++;
+		if(b->copy_no == b->copy_max)
+		{
+			b->copy_max = b->copy_max ? b->copy_max * 2 : 16;
+			b->copies = (copy_t*)arena_grow(&b->arena, b->copies, sizeof(copy_t) * b->copy_no,
+											sizeof(copy_t) * b->copy_max);
+		}
+		copy_t *c = &b->copies[b->copy_no++];
+		c->name = name;
+		c->dest = d;
+		c->size = n;
+		c->cycles = cycles;
+		c->budget = budget;
+		c->stack = stack;
+		
+		if(stack)
+		{
+			if(!b->copy_sp)
+			{
+				b->ram = 0;
+				add_var(b, COPY_SP, src->name, line_no);
+				b->vars[b->ram_var].size = 2;
+				b->vars[b->ram_var].wram = 1;
+				b->ram_var = -1;
+				b->copy_sp = 1;
+			}
+			out_byte(b, 0x08);		// LD (COPY_SP),SP
+			out_adress(b, COPY_SP, 0, 0x08, src->name, line_no);
+			out_byte(b, 0x31);		// LD SP,source
+			out_adress(b, line->name, source + done, 0x31, src->name, line_no);
+			out_byte(b, 0x21);		// LD HL,dest
+			out_adress(b, NULL, d, 0x21, src->name, line_no);
+		}
+		else
+		{
+			out_byte(b, 0x21);		// LD HL,source
+			out_adress(b, line->name, source + done, 0x21, src->name, line_no);
+			out_byte(b, 0x11);		// LD DE,dest
+			out_adress(b, NULL, d, 0x11, src->name, line_no);
+		}
+		for(i = 0; i < n; ++i)
+		{
+			if(stack)
+			{
+				if((i & 1) == 0)
+					out_byte(b, 0xC1);	// POP BC
+				out_byte(b, (i & 1) ? 0x70 : 0x71);	// LD (HL),B or C
+			}
+			else
+			{
+				out_byte(b, 0x2A);	// LD A,(HL+)
+				out_byte(b, 0x12);	// LD (DE),A
+			}
+			if(i + 1 < n && ((d + i) & 0xFF) == 0xFF)
+				out_byte(b, stack ? 0x23 : 0x13);	// INC HL or INC DE
+			else if(i + 1 < n)
+				out_byte(b, stack ? 0x2C : 0x1C);	// INC L or INC E
+		}
+		if(stack)
+		{
+			// LD HL,COPY_SP; LD A,(HL+); LD H,(HL); LD L,A; LD SP,HL
+			out_byte(b, 0x21);
+			out_adress(b, COPY_SP, 0, 0x21, src->name, line_no);
+			out_byte(b, 0x2A);
+			out_byte(b, 0x66);
+			out_byte(b, 0x6F);
+			out_byte(b, 0xF9);
+		}
+		out_byte(b, 0xC9);
+		done += n;
+	}
+}
+
+/**
+ * Prints the routines of the .vramcopy lines with their cycles.
+ */
+void print_copies(build_t *b)
+{
+	unsigned int i;
+	fprintf(b->msg, "VRAM copies:\n");
+	for(i = 0; i < b->copy_no; ++i)
+	{
+		copy_t *c = &b->copies[i];
+		fprintf(b->msg, "  %s: 0x%X byte%s to 0x%X in 0x%lX of 0x%lX cycles%s\n", c->name, 
+				c->size, c->size != 1 ? "s" : "", c->dest, c->cycles, c->budget, 
+				c->stack ? ", from the stack" : "");
+	}
+}
+
+/**
+ * Tells if an encoded instruction never runs on to the next one: an 
+ * unconditional JP, JR, RET or RETI.
+ */
+int is_terminator(line_t *line)
+{
+	if(line->byte_no == 0)
+		return 0;
+	switch(line->bytes[0])
+	{
+		case 0xC3: case 0x18: case 0xC9: case 0xD9: case 0xE9:
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Compares blocks by name.
+ */
+int cmp_block(const void *a, const void *b)
+{
+	return strcmp(((block_t*)a)->name, ((block_t*)b)->name);
+}
+
+/**
+ * Ends the block of a .library section that is open, if any.
+ */
+void end_block(build_t *b)
+{
+	if(b->block_open)
+		b->blocks[b->block_no-1].end = b->out_no;
+	b->block_open = 0;
+	b->dropping = 0;
+}
+
+/**
+ * Starts a block of a .library section at a named label. With --strip, the
+ * lines of the block are dropped if it was found unreachable before.
+ */
+void begin_block(build_t *b, char *name)
+{
+	int prev = b->block_open ? (int)b->block_no - 1 : -1;
+	end_block(b);
+	if(b->stripped_no > 0)
+	{
+		block_t key;
+		key.name = name;
+		b->dropping = bsearch(&key, b->stripped, b->stripped_no, sizeof(block_t), 
+							  cmp_block) != NULL;
+		if(b->dropping)
+		{
+			close_scope(b);
+			return;
+		}
+	}
+	if(!b->strip)
+		return;
+	if(b->block_no == b->block_max)
+	{
+		b->block_max = b->block_max ? b->block_max * 2 : 64;
+		b->blocks = (block_t*)arena_grow(&b->arena, b->blocks, sizeof(block_t) * b->block_no,
+										 sizeof(block_t) * b->block_max);
+	}
+	block_t *k = &b->blocks[b->block_no++];
+	k->name = name;
+	k->start = b->out_no;
+	k->end = b->out_no;
+	k->prev = prev;
+	k->falls_in = b->falls;
+	k->reachable = 0;
+	b->block_open = 1;
+}
+
+/**
+ * Finds the block of a .library section at a byte position, -1 if the 
+ * position is outside all of them.
+ */
+int find_block(build_t *b, unsigned int pos)
+{
+	int lo = 0, hi = (int)b->block_no - 1;
+	while(lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		if(pos < b->blocks[mid].start)
+			hi = mid - 1;
+		else if(pos >= b->blocks[mid].end)
+			lo = mid + 1;
+		else
+			return mid;
+	}
+	return -1;
+}
+
+/**
+ * Finds the blocks of the .library sections that cannot be reached after a 
+ * build. Everything outside of them (the entry point, interrupt vectors and 
+ * the rest of the program) is reachable, and so is every block that is 
+ * referenced by reachable code, or that reachable code runs on into. The 
+ * unreachable ones are kept in b->stripped, to leave them out of the next 
+ * build. Returns the amount of them.
+ */
+int strip_blocks(build_t *b)
+{
+	unsigned int i;
+	int changed = 1;
+	while(changed)
+	{
+		changed = 0;
+		for(i = 0; i < b->block_no; ++i)
+		{
+			block_t *k = &b->blocks[i];
+			if(!k->reachable && k->falls_in && (k->prev < 0 || b->blocks[k->prev].reachable))
+				changed = k->reachable = 1;
+		}
+		for(i = 0; i < b->labels.no; ++i)
+		{
+			label_t *l = &b->labels.list[i];
+			int t = find_block(b, l->pointsto);
+			if(t < 0 || b->blocks[t].reachable)
+				continue;
+			label_ref_t *r;
+			for(r = l->refs; r != NULL; r = r->next)
+			{
+				int from = find_block(b, r->pos);
+				if(from < 0 || b->blocks[from].reachable)
+				{
+					changed = b->blocks[t].reachable = 1;
+					break;
+				}
+			}
+		}
+	}
+	
+	free(b->stripped);
+	b->stripped = NULL;
+	b->stripped_no = 0;
+	for(i = 0; i < b->block_no; ++i)
+	{
+		if(b->blocks[i].reachable)
+			continue;
+		if(b->stripped_no % 64 == 0)
+			b->stripped = (block_t*)realloc(b->stripped, sizeof(block_t) * (b->stripped_no + 64));
+		b->stripped[b->stripped_no++] = b->blocks[i];
+	}
+	qsort(b->stripped, b->stripped_no, sizeof(block_t), cmp_block);
+	return b->stripped_no;
+}
+
+/**
+ * Lists the blocks left out by --strip and the bytes saved.
+ */
+void print_stripped(build_t *b)
+{
+	unsigned int i, saved = 0;
+	for(i = 0; i < b->stripped_no; ++i)
+		saved += b->stripped[i].end - b->stripped[i].start;
+	fprintf(b->msg, "Stripped %u unreachable routine%s, %u bytes saved:\n", b->stripped_no, 
+			b->stripped_no != 1 ? "s" : "", saved);
+	for(i = 0; i < b->stripped_no; ++i)
+		fprintf(b->msg, "  %s (%u bytes)\n", b->stripped[i].name, 
+				b->stripped[i].end - b->stripped[i].start);
+}
+
+/**
+ * Tells if a line is .data without labels, which can be moved anywhere.
+ */
+int is_plain_data(line_t *line)
+{
+	return line->kind == LINE_DATA && line->fixup_no == 0 
+		   && strncmp(line->str, ".align", 6) != 0;
+}
+
+/**
+ * Compares merged data blocks by name.
+ */
+int cmp_merge(const void *a, const void *b)
+{
+	return strcmp(((merge_t*)a)->name, ((merge_t*)b)->name);
+}
+
+/**
+ * Ends the data block that is open, if any.
+ */
+void end_span(build_t *b)
+{
+	if(b->span_open)
+		b->spans[b->span_no-1].end = b->out_no;
+	b->span_open = 0;
+	b->merging = 0;
+}
+
+/**
+ * Starts a data block at a named label. With --dedup, the lines of the block
+ * are dropped if it was found to be a duplicate before, the label is set to 
+ * the copy after the first pass.
+ */
+void begin_span(build_t *b, char *name)
+{
+	end_span(b);
+	if(b->merged_no > 0)
+	{
+		merge_t key;
+		key.name = name;
+		b->merging = bsearch(&key, b->merged, b->merged_no, sizeof(merge_t), 
+							 cmp_merge) != NULL;
+		if(b->merging)
+		{
+			close_scope(b);
+			return;
+		}
+	}
+	if(!b->dedup || b->dropping)
+		return;
+	if(b->span_no == b->span_max)
+	{
+		b->span_max = b->span_max ? b->span_max * 2 : 64;
+		b->spans = (span_t*)arena_grow(&b->arena, b->spans, sizeof(span_t) * b->span_no,
+									   sizeof(span_t) * b->span_max);
+	}
+	span_t *k = &b->spans[b->span_no++];
+	k->name = name;
+	k->start = b->out_no;
+	k->end = b->out_no;
+	k->pinned = b->org == b->out_no;
+	b->span_open = 1;
+}
+
+/**
+ * Compares data blocks by size and hash, then by position.
+ */
+int cmp_span(const void *a, const void *b)
+{
+	const span_t *x = *(const span_t**)a, *y = *(const span_t**)b;
+	unsigned int xn = x->end - x->start, yn = y->end - y->start;
+	if(xn != yn)
+		return xn < yn ? -1 : 1;
+	if(x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return x->start < y->start ? -1 : (x->start > y->start);
+}
+
+/**
+ * Finds data blocks with the same bytes as an earlier one after a build. A 
+ * block can use a copy in bank 0 or in its own bank, blocks right after an 
+ * unnamed label are not moved, and neither are the blocks of code stripped 
+ * anyway. The duplicates are kept in b->merged, to leave them out of the next
+ * build. Returns the amount of them.
+ */
+int merge_data(build_t *b)
+{
+	unsigned int i, j, n = 0;
+	span_t **sorted = (span_t**)malloc(sizeof(span_t*) * (b->span_no + 1));
+	for(i = 0; i < b->span_no; ++i)
+	{
+		span_t *k = &b->spans[i];
+		int t = find_block(b, k->start);
+		if(k->end > k->start && (t < 0 || b->blocks[t].reachable))
+		{
+			k->hash = hash_bytes(HASH_INIT, b->out + k->start, k->end - k->start);
+			sorted[n++] = k;
+		}
+	}
+	// Identical blocks end up next to each other, in order of position
+	qsort(sorted, n, sizeof(span_t*), cmp_span);
+	
+	free(b->merged);
+	b->merged = NULL;
+	b->merged_no = 0;
+	for(i = 0; i < n; i = j)
+	{
+		unsigned int size = sorted[i]->end - sorted[i]->start;
+		for(j = i + 1; j < n && sorted[j]->end - sorted[j]->start == size 
+			&& sorted[j]->hash == sorted[i]->hash; ++j)
+			;
+		// First copy in bank 0 or the same bank that is not merged itself
+		unsigned int k, m;
+		for(k = i + 1; k < j; ++k)
+		{
+			span_t *dup = sorted[k];
+			if(dup->pinned)
+				continue;
+			for(m = i; m < k; ++m)
+			{
+				unsigned int bank = sorted[m]->start / BANK_SIZE;
+				if(sorted[m]->name != NULL && (bank == 0 || bank == dup->start / BANK_SIZE)
+				   && memcmp(b->out + sorted[m]->start, b->out + dup->start, size) == 0)
+					break;
+			}
+			if(m == k)
+				continue;
+			if(b->merged_no % 64 == 0)
+				b->merged = (merge_t*)realloc(b->merged, sizeof(merge_t) * (b->merged_no + 64));
+			b->merged[b->merged_no].name = dup->name;
+			b->merged[b->merged_no].target = sorted[m]->name;
+			b->merged[b->merged_no++].size = size;
+			dup->name = NULL;
+		}
+	}
+	free(sorted);
+	qsort(b->merged, b->merged_no, sizeof(merge_t), cmp_merge);
+	return b->merged_no;
+}
+
+/**
+ * Sets the labels of the data blocks left out by --dedup to their copies.
+ */
+void alias_merged(build_t *b)
+{
+	unsigned int i;
+	for(i = 0; i < b->merged_no; ++i)
+		find_label(b, &b->labels, b->merged[i].name)->pointsto = 
+			find_label(b, &b->labels, b->merged[i].target)->pointsto;
+}
+
+/**
+ * Lists the data blocks merged by --dedup and the bytes saved.
+ */
+void print_merged(build_t *b)
+{
+	unsigned int i, saved = 0;
+	for(i = 0; i < b->merged_no; ++i)
+		saved += b->merged[i].size;
+	fprintf(b->msg, "Merged %u duplicate data block%s, %u bytes saved:\n", b->merged_no, 
+			b->merged_no != 1 ? "s" : "", saved);
+	for(i = 0; i < b->merged_no; ++i)
+		fprintf(b->msg, "  %s -> %s (%u bytes)\n", b->merged[i].name, 
+				b->merged[i].target, b->merged[i].size);
+}
+
+/**
+ * Compresses data with run lengths. Each control byte is followed by a run of
+ * 1-7F bytes (its value) to copy, or for 80-FF by a byte to repeat 2-81 
+ * times (its value - 7E). A 00 ends the data. Returns a malloc'd buffer.
+ */
+unsigned char *pack_rle(unsigned char *data, unsigned int len, unsigned int *size)
+{
+	unsigned char *out = (unsigned char*)malloc(len + len / MAX_LITERALS + 2);
+	unsigned int i = 0, lit = 0, n = 0;
+	while(i <= len)
+	{
+		unsigned int run = 1;
+		while(i + run < len && run < RLE_MAX_RUN && data[i+run] == data[i])
+			++run;
+		// Literals pending before a run, a full literal run or the end
+		if(lit < i && (run > 2 || i - lit == MAX_LITERALS || i == len))
+		{
+			out[n++] = i - lit;
+			memcpy(out + n, data + lit, i - lit);
+			n += i - lit;
+			lit = i;
+		}
+		if(i == len)
+			break;
+		if(run > 2)
+		{
+			out[n++] = 0x80 | (run - 2);
+			out[n++] = data[i];
+			i += run;
+			lit = i;
+		}
+		else
+			++i;
+	}
+	out[n++] = 0;
+	*size = n;
+	return out;
+}
+
+/**
+ * Compresses data with LZ77. Each control byte is followed by a run of 1-7F
+ * bytes (its value) to copy, or for 80-FF by the distance - 1 to bytes 
+ * written before, of which 3-82 (its value - 7D) are copied again. A 00 ends
+ * the data. The matches are looked for at up to level earlier positions, 
+ * nearest first. Returns a malloc'd buffer.
+ */
+unsigned char *pack_lz(unsigned char *data, unsigned int len, unsigned int level, 
+					   unsigned int *size)
+{
+	unsigned char *out = (unsigned char*)malloc(len + len / MAX_LITERALS + 2);
+	unsigned int i = 0, lit = 0, n = 0;
+	while(i <= len)
+	{
+		unsigned int best = 0, dist = 0, j, tries = 0;
+		for(j = i; i < len && j > 0 && i - j < LZ_WINDOW && tries < level; ++tries)
+		{
+			--j;
+			if(data[j] != data[i])
+				continue;
+			// Matches may run into the bytes they copy
+			unsigned int m = 1;
+			while(m < LZ_MAX_MATCH && i + m < len && data[j+m] == data[i+m])
+				++m;
+			if(m > best)
+			{
+				best = m;
+				dist = i - j;
+				if(m == LZ_MAX_MATCH)
+					break;
+			}
+		}
+		if(lit < i && (best >= LZ_MIN_MATCH || i - lit == MAX_LITERALS || i == len))
+		{
+			out[n++] = i - lit;
+			memcpy(out + n, data + lit, i - lit);
+			n += i - lit;
+			lit = i;
+		}
+		if(i == len)
+			break;
+		if(best >= LZ_MIN_MATCH)
+		{
+			out[n++] = 0x80 | (best - LZ_MIN_MATCH);
+			out[n++] = dist - 1;
+			i += best;
+			lit = i;
+		}
+		else
+			++i;
+	}
+	out[n++] = 0;
+	*size = n;
+	return out;
+}
+
+/**
+ * Returns the compressed contents of a binary file, with level 0 for rle or 
+ * the level of lz. Results are kept by a hash of the contents, in memory and
+ * in the --cache directory, so unchanged data is only compressed once. Must 
+ * be called with _encode_lock held.
+ */
+packed_t *pack_binary(build_t *b, source_t *bin, unsigned int level)
+{
+	unsigned long long key = hash_bytes(bin->hash, &bin->len, sizeof(bin->len));
+	key = hash_bytes(key, &level, sizeof(level));
+	packed_t *pk;
+	for(pk = _packed; pk != NULL; pk = pk->next)
+		if(pk->key == key)
+			return pk;
+	
+	pk = (packed_t*)malloc(sizeof(packed_t));
+	pk->key = key;
+	pk->data = NULL;
+#ifdef __linux__
+	char name[INCL_FLEN * 2];
+	if(b->cache_dir != NULL)
+	{
+		snprintf(name, sizeof(name), "%s/%016llx.z", b->cache_dir, key);
+		pk->data = read_binary(name, &pk->size);
+	}
+#endif
+	if(pk->data == NULL)
+	{
+		unsigned char *data = (unsigned char*)bin->text;
+		pk->data = level == 0 ? pack_rle(data, bin->len, &pk->size)
+							  : pack_lz(data, bin->len, level, &pk->size);
+#ifdef __linux__
+		if(b->cache_dir != NULL && (mkdir(b->cache_dir, 0777) == 0 || errno == EEXIST))
+			cache_write(name, pk->data, pk->size);
+#endif
+	}
+	pk->next = _packed;
+	_packed = pk;
+	return pk;
+}
+
+/**
+ * Declares a variable of a .ramsection, its size is added by the .ds lines
+ * that follow.
+ */
+void add_var(build_t *b, char *name, char *filename, unsigned int line_no)
+{
+	if(b->var_no == b->var_max)
+	{
+		b->var_max = b->var_max ? b->var_max * 2 : 64;
+		b->vars = (var_t*)arena_grow(&b->arena, b->vars, sizeof(var_t) * b->var_no,
+									 sizeof(var_t) * b->var_max);
+	}
+	var_t *v = &b->vars[b->var_no];
+	v->name = name;
+	v->size = 0;
+	v->order = b->var_no;
+	v->wram = b->ram >= 2;
+	v->owner = b->ram == 3 ? b->routine : NULL;
+	v->count = 0;
+	v->adress = 0;
+	v->filename = filename;
+	v->line_no = line_no;
+	b->ram_var = b->var_no++;
+}
+
+/**
+ * Compares variables by name.
+ */
+int cmp_var(const void *a, const void *b)
+{
+	return strcmp(((var_t*)a)->name, ((var_t*)b)->name);
+}
+
+/**
+ * Compares variables by accesses per byte, most first, then by declaration.
+ */
+int cmp_var_hot(const void *a, const void *b)
+{
+	const var_t *x = (const var_t*)a, *y = (const var_t*)b;
+	unsigned long long cx = (unsigned long long)x->count * (y->size ? y->size : 1);
+	unsigned long long cy = (unsigned long long)y->count * (x->size ? x->size : 1);
+	if(cx != cy)
+		return cx > cy ? -1 : 1;
+	return x->order < y->order ? -1 : (x->order > y->order);
+}
+
+/**
+ * Compares variables by declaration.
+ */
+int cmp_var_order(const void *a, const void *b)
+{
+	unsigned int x = ((const var_t*)a)->order, y = ((const var_t*)b)->order;
+	return x < y ? -1 : (x > y);
+}
+
+/**
+ * Tells if a label is a variable of a .ramsection placed by the last build.
+ * These are not in the ROM.
+ */
+int is_var(build_t *b, char *name)
+{
+	var_t key;
+	key.name = name;
+	return b->layout_no > 0 
+		   && bsearch(&key, b->layout, b->layout_no, sizeof(var_t), cmp_var) != NULL;
+}
+
+/**
+ * Returns the adress of the variable an LD A,(nn) or LD (nn),A accesses if 
+ * the last build placed it in HRAM, -1 otherwise.
+ */
+int ldh_adress(build_t *b, line_t *line)
+{
+	if(line->byte_no != 3 || line->fixup_no != 1 || line->fixups[0].offset != 1
+	   || (line->bytes[0] != 0xFA && line->bytes[0] != 0xEA))
+		return -1;
+	var_t key, *v;
+	key.name = line->fixups[0].string;
+	v = (var_t*)bsearch(&key, b->layout, b->layout_no, sizeof(var_t), cmp_var);
+	return (v != NULL && v->adress >= HRAM_START) ? (int)v->adress : -1;
+}
+
+/**
+ * Tells if name is in list, a list of labels separated by commas in any case.
+ */
+int in_label_list(char *list, char *name)
+{
+	size_t n = strlen(name), k;
+	while(list != NULL)
+	{
+		char *end = strchr(list, ',');
+		size_t len = end != NULL ? (size_t)(end - list) : strlen(list);
+		for(k = 0; k < len && k < n && toupper(list[k]) == name[k]; ++k);
+		if(k == len && k == n)
+			return 1;
+		list = end != NULL ? end + 1 : NULL;
+	}
+	return 0;
+}
+
+/**
+ * Starts the routine of named label i of src for --probe: it gets an ID and
+ * an entry probe if it is selected and starts code, that is the next line 
+ * that is not empty or a local label is an instruction.
+ */
+void begin_probe(build_t *b, source_t *src, unsigned int i)
+{
+	line_t *line = &src->lines[i];
+	unsigned int j;
+	b->probe_id = 0;
+	for(j = i + 1; j < src->line_no; ++j)
+		if(src->lines[j].kind != LINE_EMPTY && (src->lines[j].kind != LINE_LABEL 
+		   || strchr(".+-", *src->lines[j].name) == NULL))
+			break;
+	if(j == src->line_no || (src->lines[j].kind != LINE_INSTR && src->lines[j].kind != LINE_JUMPTABLE
+							 && src->lines[j].kind != LINE_VRAMCOPY)
+	   || b->out_no < PROBE_START 
+	   || (b->probe_labels != NULL && !in_label_list(b->probe_labels, line->name)))
+		return;
+	if(b->probe == 1 && b->probe_no == MAX_PROBES)
+	{
+		diag(b, src->name, i + 1, "Too many routines to probe, at most 0x%X are allowed with port=, "
+			 "select them with port=n:label,...", MAX_PROBES);
+		return;
+	}
+	
+	if(b->probe_no == b->probe_max)
+	{
+		b->probe_max = b->probe_max ? b->probe_max * 2 : 64;
+		b->probes = (probe_t*)arena_grow(&b->arena, b->probes, sizeof(probe_t) * b->probe_no,
+										 sizeof(probe_t) * b->probe_max);
+	}
+	probe_t *p = &b->probes[b->probe_no++];
+	p->name = line->name;
+	p->pos = 0;
+	p->filename = src->name;
+	p->line_no = i + 1;
+	b->probe_id = b->probe_no;
+	// Not part of a data block that could be merged
+	end_span(b);
+	put_probe(b, 0);
+}
+
+/**
+ * Puts a probe of the routine b->probe_id in the output, keeping all 
+ * registers and flags. With port=n the entry probe (exit 0) writes the ID to
+ * n and the exit probe to n + 1: PUSH AF; LD A,id; LD (n),A; POP AF, in 52 
+ * cycles, or 48 with LDH for an adress from FF00. With counters the entry 
+ * probe adds one to the counter of the routine: PUSH AF; PUSH HL; 
+ * LD HL,counter; INC (HL); JR NZ,+2; INC HL; INC (HL); POP HL; POP AF, in 92
+ * cycles (108 when the low byte wraps). The adress of the counter is filled 
+ * in by patch_probes.
+ */
+void put_probe(build_t *b, int exit)
+{
+	static const unsigned char count[] = {0xF5, 0xE5, 0x21, 0x00, 0x00, 0x34, 0x20, 0x02, 
+										  0x23, 0x34, 0xE1, 0xF1};
+	unsigned char code[sizeof(count)];
+	unsigned int n = 0, port = (b->probe_port + exit) & 0xFFFF;
+	if(b->probe == 1)
+	{
+		code[n++] = 0xF5;
+		code[n++] = 0x3E;
+		code[n++] = b->probe_id;
+		if(port >= 0xFF00)
+		{
+			code[n++] = 0xE0;
+			code[n++] = port & 0xFF;
+		}
+		else
+		{
+			code[n++] = 0xEA;
+			code[n++] = port & 0xFF;
+			code[n++] = port >> 8;
+		}
+		code[n++] = 0xF1;
+	}
+	else
+	{
+		memcpy(code, count, sizeof(count));
+		n = sizeof(count);
+		b->probes[b->probe_id-1].pos = b->out_no + 3;
+	}
+	if(!b->check)
+	{
+		out_reserve(b, n);
+		memcpy(b->out + b->out_no, code, n);
+	}
+	b->out_no += n;
+}
+
+/**
+ * Puts the exit probe of the routine b->probe_id before a RET or RETI line. 
+ * A conditional RET cc gets JR !cc over the probe and the RET cc first, so 
+ * that the probe only runs when the routine returns. That takes 4 cycles more
+ * when it does not return.
+ */
+void put_exit_probe(build_t *b, line_t *line)
+{
+	if(line->byte_no != 1)
+		return;
+	unsigned char op = line->bytes[0];
+	if(op == 0xC9 || op == 0xD9)
+	{
+		put_probe(b, 1);
+		return;
+	}
+	if((op & 0xE7) != 0xC0)
+		return;
+	// RET NZ, Z, NC, C: JR Z, NZ, C, NC
+	unsigned int pos = b->out_no + 1;
+	out_byte(b, 0x20 | ((op & 0x18) ^ 0x08));
+	out_byte(b, 0);
+	put_probe(b, 1);
+	patch_ref(b, pos, 1, b->out_no + line->byte_no);
+}
+
+/**
+ * Adds the table of the probe counters to the variables after the first pass,
+ * two bytes per routine, so that place_ram puts it in WRAM.
+ */
+void reserve_probes(build_t *b)
+{
+	if(b->probe != 2 || b->probe_no == 0)
+		return;
+	b->ram = 0;
+	add_var(b, PROBE_TABLE, b->probes[0].filename, b->probes[0].line_no);
+	b->vars[b->ram_var].size = b->probe_no * 2;
+	b->vars[b->ram_var].wram = 1;
+	b->ram_var = -1;
+}
+
+/**
+ * Fills in the adresses of the counters in the probes, once the table is 
+ * placed.
+ */
+void patch_probes(build_t *b)
+{
+	unsigned int i;
+	if(b->probe != 2 || b->probe_no == 0)
+		return;
+	b->probe_table = find_label(b, &b->labels, PROBE_TABLE)->pointsto;
+	for(i = 0; i < b->probe_no; ++i)
+		patch_ref(b, b->probes[i].pos, 0, b->probe_table + i * 2);
+}
+
+/**
+ * Writes the IDs and labels of the routines with probes to filename.probes.
+ * Returns 0 if it cannot be written.
+ */
+int write_probes(build_t *b, char *filename)
+{
+	char name[INCL_FLEN + 8];
+	unsigned int i;
+	snprintf(name, sizeof(name), "%s.probes", filename);
+	FILE *f = fopen(name, "w");
+	if(f == NULL)
+		return 0;
+	if(b->probe == 1)
+		fprintf(f, "# ID and label of each routine. The ID is written to 0x%04X on entry, "
+				"to 0x%04X on return.\n", b->probe_port, (b->probe_port + 1) & 0xFFFF);
+	else
+		fprintf(f, "# ID and label of each routine. The calls of ID n are counted in the "
+				"16 bit word (little endian) at 0x%04X + (n - 1) * 2.\n", b->probe_table);
+	for(i = 0; i < b->probe_no; ++i)
+		fprintf(f, "%02X %s\n", i + 1, b->probes[i].name);
+	return fclose(f) == 0;
+}
+
+/**
+ * Places the variables of the .ramsections after the first pass and defines
+ * their labels. The ones accessed most by LD A,(nn) and LD (nn),A per byte,
+ * or by the counts of the --profile, go to HRAM as far as they fit, the rest
+ * to WRAM in order of declaration. b->ldh_no is set to the accesses that can
+ * use LDH. A build with b->layout_fixed keeps the places of the last build.
+ */
+void place_ram(build_t *b)
+{
+	unsigned int i;
+	if(!b->layout_fixed)
+	{
+		// Static accesses, replaced by the profiled ones
+		for(i = 0; i < b->var_no; ++i)
+		{
+			label_ref_t *r;
+			for(r = find_label(b, &b->labels, b->vars[i].name)->refs; r != NULL; r = r->next)
+				if(!r->relative && (r->op == 0xFA || r->op == 0xEA))
+					b->vars[i].count++;
+		}
+		FILE *f = b->profile != NULL ? fopen(b->profile, "r") : NULL;
+		char buf[IN_BUFLEN], name[IN_BUFLEN];
+		unsigned long count;
+		while(f != NULL && fgets(buf, sizeof(buf), f) != NULL)
+		{
+			if(sscanf(buf, "%s %lu", name, &count) != 2)
+				continue;
+			strtoupper(name);
+			for(i = 0; i < b->var_no; ++i)
+				if(strcmp(b->vars[i].name, name) == 0)
+					b->vars[i].count = count;
+		}
+		if(f != NULL)
+			fclose(f);
+		
+		free(b->layout);
+		b->layout = (var_t*)malloc(sizeof(var_t) * (b->var_no + 1));
+		b->layout_no = b->var_no;
+		memcpy(b->layout, b->vars, sizeof(var_t) * b->var_no);
+		qsort(b->layout, b->layout_no, sizeof(var_t), cmp_var_hot);
+		unsigned int hram = 0, wram = 0;
+		for(i = 0; i < b->layout_no; ++i)
+		{
+			var_t *v = &b->layout[i];
+			v->adress = 0;
+			if(!v->wram && v->owner == NULL && v->count > 0 && v->size > 0 
+			   && hram + v->size <= b->hram_size)
+			{
+				v->adress = HRAM_START + hram;
+				hram += v->size;
+			}
+		}
+		qsort(b->layout, b->layout_no, sizeof(var_t), cmp_var_order);
+		for(i = 0; i < b->layout_no; ++i)
+		{
+			var_t *v = &b->layout[i];
+			if(v->adress != 0 || v->owner != NULL)
+				continue;
+			v->adress = WRAM_START + wram;
+			wram += v->size;
+			if(wram > WRAM_SIZE && wram - v->size <= WRAM_SIZE)
+				diag(b, v->filename, v->line_no, "Variable \'%s\' does not fit in WRAM anymore!", v->name);
+		}
+		wram = place_overlay(b, WRAM_START + wram) - WRAM_START;
+		if(wram > WRAM_SIZE && b->overlay_size > 0)
+			diag(b, b->layout[0].filename, b->layout[0].line_no, 
+				 "Local variables need 0x%X bytes at 0x%X, more than is left of WRAM!", 
+				 b->overlay_size, b->overlay);
+		b->ldh_no = 0;
+		for(i = 0; i < b->layout_no; ++i)
+			if(b->layout[i].adress >= HRAM_START)
+				b->ldh_no += b->layout[i].count;
+		qsort(b->layout, b->layout_no, sizeof(var_t), cmp_var);
+	}
+	for(i = 0; i < b->layout_no; ++i)
+		find_label(b, &b->labels, b->layout[i].name)->pointsto = b->layout[i].adress;
+}
+
+/**
+ * Marks the routines reachable from routine n in reach, following the calls
+ * and jumps of the call graph (callees of routine i are callee[first[i]] up 
+ * to callee[first[i+1]]).
+ */
+void mark_reach(char *reach, int n, unsigned int *first, unsigned int *callee, 
+				unsigned int routine_no)
+{
+	unsigned int *stack = (unsigned int*)malloc(sizeof(unsigned int) * (routine_no + 1));
+	unsigned int depth = 0, i;
+	if(!reach[n])
+	{
+		reach[n] = 1;
+		stack[depth++] = n;
+	}
+	while(depth > 0)
+	{
+		unsigned int r = stack[--depth];
+		for(i = first[r]; i < first[r+1]; ++i)
+			if(!reach[callee[i]])
+			{
+				reach[callee[i]] = 1;
+				stack[depth++] = callee[i];
+			}
+	}
+	free(stack);
+}
+
+/**
+ * Tells if the local variables of two routines may be in use at the same 
+ * time: one of them runs while the other is active, or one of them runs from 
+ * an interrupt.
+ */
+int frames_conflict(frame_t *f, frame_t *g)
+{
+	if(f->routine < 0 || g->routine < 0 || f->irq || g->irq)
+		return 1;
+	return f->reach[g->routine] || g->reach[f->routine];
+}
+
+/**
+ * Places the local variables of the routines in an overlay at base, after the
+ * first pass. The static call graph (CALL, JP, JR and RST to labels) tells 
+ * which routines can be active at the same time; the variables of those that
+ * cannot share the same space. Routines only reached through pointers are not
+ * seen, their variables must not be local. Returns the end of the overlay.
+ */
+unsigned int place_overlay(build_t *b, unsigned int base)
+{
+	unsigned int i, j, frame_no = 0;
+	frame_t *frames = (frame_t*)calloc(b->layout_no + 1, sizeof(frame_t));
+	for(i = 0; i < b->layout_no; ++i)
+	{
+		var_t *v = &b->layout[i];
+		if(v->owner == NULL)
+			continue;
+		for(j = 0; j < frame_no && strcmp(frames[j].owner, v->owner) != 0; ++j);
+		if(j == frame_no)
+		{
+			frames[frame_no].owner = v->owner;
+			frames[frame_no++].routine = -1;
+		}
+		frames[j].size += v->size;
+	}
+	b->overlay = base;
+	b->overlay_size = 0;
+	b->overlay_unshared = 0;
+	if(frame_no == 0)
+	{
+		free(frames);
+		return base;
+	}
+	
+	// Call graph of the routines, without the labels of variables. In a 
+	// check the output is not there, all routines then conflict.
+	unsigned int routine_no = 0, *room = NULL, *first = NULL, *callee = NULL;
+	routine_t *r = NULL;
+	if(!b->check)
+	{
+		r = find_routines(b, &routine_no, &room);
+		first = (unsigned int*)calloc(routine_no + 2, sizeof(unsigned int));
+		unsigned int pass, edge_no = 0;
+		for(pass = 0; pass < 2; ++pass)
+		{
+			for(i = 0; i < b->labels.no + b->site_no; ++i)
+			{
+				label_ref_t rst, *ref;
+				int to;
+				if(i < b->labels.no)
+				{
+					to = find_routine(r, routine_no, b->labels.list[i].pointsto);
+					ref = b->labels.list[i].refs;
+				}
+				else
+				{
+					site_t *s = &b->sites[i - b->labels.no];
+					if(s->op == 0xEA)
+						continue;
+					rst.pos = s->pos;
+					rst.op = s->op;
+					rst.next = NULL;
+					to = find_routine(r, routine_no, s->op & 0x38);
+					ref = &rst;
+				}
+				for(; ref != NULL && to >= 0; ref = ref->next)
+				{
+					int from = find_routine(r, routine_no, ref->pos);
+					if(from < 0 || from == to || jump_kind(ref->op) == NULL)
+						continue;
+					// Counted first, then put in place
+					if(pass == 0)
+						first[from + 2]++;
+					else
+						callee[first[from + 1]++] = to;
+				}
+			}
+			if(pass == 0)
+			{
+				for(j = 0; j < routine_no; ++j)
+					first[j + 2] += first[j + 1];
+				edge_no = first[routine_no + 1];
+				callee = (unsigned int*)malloc(sizeof(unsigned int) * (edge_no + 1));
+			}
+		}
+		
+		char *irq = (char*)calloc(routine_no + 1, 1);
+		for(j = 0; j < routine_no; ++j)
+			if(r[j].start >= IRQ_START && r[j].start < IRQ_END)
+				mark_reach(irq, j, first, callee, routine_no);
+		for(i = 0; i < frame_no; ++i)
+		{
+			label_t *l = find_label(b, &b->labels, frames[i].owner);
+			frames[i].routine = find_routine(r, routine_no, l->pointsto);
+			if(frames[i].routine < 0)
+				continue;
+			frames[i].reach = (char*)calloc(routine_no + 1, 1);
+			mark_reach(frames[i].reach, frames[i].routine, first, callee, routine_no);
+			frames[i].irq = irq[frames[i].routine];
+		}
+		free(irq);
+	}
+	
+	// Largest first, each at the lowest offset clear of the conflicting ones
+	unsigned int k;
+	for(k = 0; k < frame_no; ++k)
+	{
+		frame_t *f = NULL;
+		for(i = 0; i < frame_no; ++i)
+			if(!frames[i].placed && (f == NULL || frames[i].size > f->size))
+				f = &frames[i];
+		unsigned int offset = 0;
+		int moved = 1;
+		while(moved)
+		{
+			moved = 0;
+			for(i = 0; i < frame_no; ++i)
+			{
+				frame_t *g = &frames[i];
+				if(g->placed && offset < g->offset + g->size && g->offset < offset + f->size 
+				   && frames_conflict(f, g))
+				{
+					offset = g->offset + g->size;
+					moved = 1;
+				}
+			}
+		}
+		f->offset = offset;
+		f->placed = 1;
+		if(offset + f->size > b->overlay_size)
+			b->overlay_size = offset + f->size;
+		b->overlay_unshared += f->size;
+	}
+	
+	// The variables of a routine in order of declaration
+	for(i = 0; i < b->layout_no; ++i)
+	{
+		var_t *v = &b->layout[i];
+		if(v->owner == NULL)
+			continue;
+		for(j = 0; strcmp(frames[j].owner, v->owner) != 0; ++j);
+		v->adress = base + frames[j].offset;
+		frames[j].offset += v->size;
+	}
+	
+	for(i = 0; i < frame_no; ++i)
+		free(frames[i].reach);
+	free(frames);
+	free(r);
+	free(room);
+	free(first);
+	free(callee);
+	return base + b->overlay_size;
+}
+
+/**
+ * Prints how much of WRAM and HRAM the variables use, and where the local 
+ * variables of each routine are in the overlay.
+ */
+void print_layout(build_t *b)
+{
+	unsigned int i, j, wram = b->overlay_size, hram = 0;
+	for(i = 0; i < b->layout_no; ++i)
+	{
+		if(b->layout[i].owner != NULL)
+			continue;
+		if(b->layout[i].adress >= HRAM_START)
+			hram += b->layout[i].size;
+		else
+			wram += b->layout[i].size;
+	}
+	fprintf(b->msg, "Variables: 0x%X bytes of WRAM, 0x%X bytes of HRAM, %u access%s by LDH.\n",
+			wram, hram, b->ldh_no, b->ldh_no != 1 ? "es" : "");
+	if(b->overlay_size == 0)
+		return;
+	fprintf(b->msg, "Local variables at 0x%X: 0x%X bytes, 0x%X without sharing.\n", 
+			b->overlay, b->overlay_size, b->overlay_unshared);
+	// Each routine once, at its first variable
+	for(i = 0; i < b->layout_no; ++i)
+	{
+		var_t *v = &b->layout[i];
+		if(v->owner == NULL)
+			continue;
+		unsigned int start = v->adress, end = v->adress + v->size;
+		for(j = 0; j < b->layout_no; ++j)
+		{
+			var_t *w = &b->layout[j];
+			if(w->owner == NULL || strcmp(w->owner, v->owner) != 0)
+				continue;
+			if(j < i)
+				break;
+			if(w->adress < start)
+				start = w->adress;
+			if(w->adress + w->size > end)
+				end = w->adress + w->size;
+		}
+		if(j == b->layout_no)
+			fprintf(b->msg, "  %s: 0x%X-0x%X\n", v->owner, start, end - 1);
+	}
+}
+
+/**
+ * Loads an included file. The name is tried as it is first, then in each of 
+ * the -I directories in order.
+ */
+source_t *load_include(build_t *b, char *filename, int binary)
+{
+	char path[INCL_FLEN * 2];
+	size_t i;
+	source_t *src = load_file(filename, binary);
+	for(i = 0; src == NULL && filename[0] != '/' && i < b->include_dir_no; ++i)
+	{
+		snprintf(path, sizeof(path), "%s/%s", b->include_dirs[i], filename);
+		src = load_file(path, binary);
+	}
+	return src;
+}
+
+/**
+ * First pass over a loaded file. Copies the bytecode of the assembled lines 
+ * to the output, and stores label source bytepositions. Lines are encoded the
+ * first time they are needed, .if blocks that do not hold are jumped over 
+ * without looking at them. Leaves labels in instructions intact (parsed in 
+ * second pass).
+ */
+void parse_file_pass1(build_t *b, source_t *src)
+{
+	unsigned int i, j;
+	
+	add_dep(b, src);
+	
+	for(i = 0; i < src->line_no; ++i)
+	{
+		if(b->stop)
+			break;
+		
+		line_t *line = &src->lines[i];
+		unsigned int line_no = i + 1;
+		source_t *inc;
+		int cond;
+		if((line->kind == LINE_INSTR || line->kind == LINE_DATA || line->kind == LINE_JUMPTABLE) 
+		   && !__atomic_load_n(&line->encoded, __ATOMIC_ACQUIRE))
+		{
+			lock_encoding(1);
+			if(!line->encoded)
+			{
+				encode_line(src, i);
+				__atomic_store_n(&line->encoded, 1, __ATOMIC_RELEASE);
+			}
+			lock_encoding(0);
+		}
+		// Lines with errors are still assembled as well as possible
+		if(line->error != NULL)
+			diag(b, src->name, line_no, "%s", line->error);
+		if(b->ram)
+		{
+			// Only variables, .if blocks and defines in a .ramsection
+			switch(line->kind)
+			{
+				case LINE_INSTR: case LINE_DATA: case LINE_ORG: case LINE_INCLUDE:
+				case LINE_INCBIN: case LINE_LIBRARY: case LINE_ENDLIBRARY: case LINE_RAMSECTION:
+				case LINE_JUMPTABLE: case LINE_VRAMCOPY:
+					diag(b, src->name, line_no, "Only named labels and .ds are allowed in a .ramsection near %s", line->str);
+					continue;
+				case LINE_LABEL:
+					if(*line->name == '.' || *line->name == '+' || *line->name == '-')
+						diag(b, src->name, line_no, "Only named labels and .ds are allowed in a .ramsection near %s", line->str);
+					else
+						add_var(b, line->name, src->name, line_no);
+					continue;
+				default:
+					break;
+			}
+		}
+		if(b->span_open || b->merging)
+		{
+			// A data block runs up to the first line that is not plain data
+			switch(line->kind)
+			{
+				case LINE_EMPTY: case LINE_IF: case LINE_IFDEF: case LINE_IFNDEF:
+				case LINE_ELSE: case LINE_ENDIF: case LINE_DEFINE:
+					break;
+				default:
+					if(!is_plain_data(line))
+						end_span(b);
+					break;
+			}
+		}
+		
+		switch(line->kind)
+		{
+			case LINE_EMPTY:
+			case LINE_ENDIF:
+				break;
+			case LINE_IF:
+			case LINE_IFDEF:
+			case LINE_IFNDEF:
+				if(line->kind == LINE_IF)
+				{
+					cond = eval_condition(line->str+3, b->defines, &b->define_no);
+					if(cond < 0)
+					{
+						diag(b, src->name, line_no, "Syntax error, comparison expected near %s", line->str);
+						cond = 0;
+					}
+				}
+				else
+					cond = (find_define(b->defines, &b->define_no, line->name) != NULL)
+						   == (line->kind == LINE_IFDEF);
+				if(!cond)	// continue after the matching .else or .endif
+					i = line->skip;
+				break;
+			case LINE_ELSE:
+				// end of the assembled part of a block, skip up to the .endif
+				i = line->skip;
+				break;
+			case LINE_DEFINE:
+				if(set_define(b->defines, &b->define_no, line->str+7) == NULL)
+					diag(b, src->name, line_no, "Invalid define near %s", line->str);
+				break;
+			case LINE_INCLUDE:
+			case LINE_INCBIN:
+				inc = __atomic_load_n(&line->include, __ATOMIC_ACQUIRE);
+				if(inc == NULL)
+				{
+					lock_encoding(1);
+					if(line->include == NULL)
+						__atomic_store_n(&line->include, load_include(b, line->name, 
+										 line->kind == LINE_INCBIN), __ATOMIC_RELEASE);
+					inc = line->include;
+					lock_encoding(0);
+				}
+				if(inc == NULL)
+				{
+					diag(b, src->name, line_no, "Unable to open included file \'%s\'!", line->name);
+					break;
+				}
+				if(line->kind == LINE_INCLUDE)
+				{
+					parse_file_pass1(b, inc);
+					break;
+				}
+				add_dep(b, inc);
+				if(b->dropping || b->merging)
+					break;
+				lock_encoding(1);
+				packed_t *pk = pack_binary(b, inc, line->value);
+				lock_encoding(0);
+				if(!b->check && pk->size > 0)
+				{
+					out_reserve(b, pk->size);
+					memcpy(b->out + b->out_no, pk->data, pk->size);
+				}
+				b->out_no += pk->size;
+				b->falls = 0;
+				break;
+			case LINE_ORG:
+				if(line->value < b->out_no)
+				{
+					diag(b, src->name, line_no, "Cannot align to byte adress 0x%X, assembled binary size is already 0x%X!", line->value, b->out_no);
+					break;
+				}
+				b->org = line->value;
+				if(!b->check && line->value > b->out_no)
+				{
+					out_reserve(b, line->value - b->out_no);
+					memset(b->out + b->out_no, 0x00, line->value - b->out_no);
+				}
+				b->out_no = line->value;
+				break;
+			case LINE_RAMSECTION:
+				b->ram = line->value + 1;
+				b->ram_var = -1;
+				if(b->ram == 3 && b->routine == NULL)
+				{
+					diag(b, src->name, line_no, "Named label expected before a local .ramsection");
+					b->ram = 2;
+				}
+				break;
+			case LINE_ENDRAMSECTION:
+				b->ram = 0;
+				break;
+			case LINE_DS:
+				if(!b->ram)
+					diag(b, src->name, line_no, ".ds outside of a .ramsection");
+				else if(b->ram_var < 0)
+					diag(b, src->name, line_no, "Named label expected before .ds");
+				else
+					b->vars[b->ram_var].size += line->value;
+				break;
+			case LINE_LIBRARY:
+			case LINE_ENDLIBRARY:
+				end_block(b);
+				b->library = line->kind == LINE_LIBRARY;
+				break;
+			case LINE_LABEL:
+				if(*line->name != '.' && *line->name != '+' && *line->name != '-')
+				{
+					b->routine = line->name;
+					if(b->library)
+						begin_block(b, line->name);
+					begin_span(b, line->name);
+				}
+				if(!b->dropping && !b->merging)
+				{
+					define_label(b, line);
+					if(b->probe && *line->name != '.' && *line->name != '+' && *line->name != '-')
+						begin_probe(b, src, i);
+				}
+				break;
+			case LINE_VRAMCOPY:
+				if(b->dropping || b->merging)
+					break;
+				put_vramcopy(b, src, line, line_no);
+				b->falls = 0;
+				break;
+			case LINE_INSTR:
+			case LINE_DATA:
+			case LINE_JUMPTABLE:
+				if(b->dropping || b->merging)
+					break;
+				b->falls = line->kind == LINE_INSTR && !is_terminator(line);
+				if(line->kind == LINE_JUMPTABLE)
+					put_dispatch(b, line);
+				if(b->probe == 1 && b->probe_id > 0 && line->kind == LINE_INSTR)
+					put_exit_probe(b, line);
+				if(line->kind == LINE_INSTR && b->layout_fixed && ldh_adress(b, line) >= 0)
+				{
+					// LD A,(nn) and LD (nn),A of a variable in HRAM
+					if(!b->check)
+					{
+						out_reserve(b, 2);
+						b->out[b->out_no] = line->bytes[0] == 0xFA ? 0xF0 : 0xE0;
+						b->out[b->out_no+1] = ldh_adress(b, line) & 0xFF;
+					}
+					b->out_no += 2;
+					b->ldh_no++;
+					break;
+				}
+				if(!b->check && line->byte_no > 0)
+				{
+					out_reserve(b, line->byte_no);
+					memcpy(b->out + b->out_no, line->bytes, line->byte_no);
+				}
+				if(line->kind == LINE_INSTR && is_site(line))
+				{
+					if(b->site_no == b->site_max)
+					{
+						b->site_max = b->site_max ? b->site_max * 2 : 64;
+						b->sites = (site_t*)arena_grow(&b->arena, b->sites, sizeof(site_t) * b->site_no,
+													   sizeof(site_t) * b->site_max);
+					}
+					b->sites[b->site_no].pos = b->out_no;
+					b->sites[b->site_no++].op = line->bytes[0];
+				}
+				for(j = 0; j < line->fixup_no; ++j)
+				{
+					fixup_t *f = &line->fixups[j];
+					label_t *l;
+					switch(*f->string)
+					{
+						case '.':
+							l = find_label(b, &b->locals, f->string);
+							break;
+						case '+':
+							l = find_label(b, &b->forward, f->string);
+							break;
+						case '-':
+							// Defined already (unless there is none), so it is
+							// filled in right away
+							l = find_label(b, &b->backward, f->string);
+							if(l->pointsto == (unsigned int)-1)
+								diag(b, src->name, line_no, "No anonymous label \'%s\' before this reference!", f->string);
+							else if(!patch_ref(b, b->out_no + f->offset, f->relative, l->pointsto))
+								diag(b, src->name, line_no, "Relative jump to \'%s\' out of range!", f->string);
+							continue;
+						default:
+							l = find_label_hint(b, f->string, &f->label);
+							break;
+					}
+					label_ref_t *r = (label_ref_t*)arena_alloc(&b->arena, sizeof(label_ref_t));
+					r->pos = b->out_no + f->offset;
+					r->relative = f->relative;
+					r->addend = 0;
+					r->number = f->number;
+					r->filename = src->name;
+					r->line_no = line_no;
+					// Entries of a jump table count as jumps for the call graph
+					if(line->kind == LINE_JUMPTABLE)
+						r->op = 0xC3;
+					else
+						r->op = f->offset > 0 ? line->bytes[f->offset-1] : 0;
+					r->next = l->refs;
+					l->refs = r;
+					if(l->refline == (unsigned int)-1)
+					{
+						l->refline = line_no;
+						l->reffile = src->name;
+					}
+				}
+				b->out_no += line->byte_no;
+				break;
+		}
+	}
+}
+
+/**
+ * Second pass over the output. Changes all labels in their labelpositions.
+ */
+void parse_file_pass2(build_t *b)
+{
+	size_t i;
+	for(i = 0; i < b->labels.no; ++i)
+	{
+		label_t *l = &b->labels.list[i];
+		if(l->pointsto == (unsigned int)-1)
+		{
+			// LD A,(C000) and LD (C000),A, when there is no label C000
+			label_ref_t *r;
+			for(r = l->refs; r != NULL && r->number; r = r->next)
+				;
+			if(r == NULL && l->refs != NULL)
+			{
+				for(r = l->refs; r != NULL; r = r->next)
+					patch_ref(b, r->pos, 0, strtol(l->string, NULL, 16));
+				continue;
+			}
+			// References are left as zero
+			diag(b, l->reffile, l->refline, "Undefined label \'%s\' referenced!", l->string);
+			if(b->stop)
+				return;
+			continue;
+		}
+		patch_label(b, l);
+	}
+}
+
+/**
+ * Fills in the adress of a label at all its references in the output.
+ */
+void patch_label(build_t *b, label_t *l)
+{
+	label_ref_t *r;
+	for(r = l->refs; r != NULL; r = r->next)
+		if(!patch_ref(b, r->pos, r->relative, l->pointsto + r->addend))
+			diag(b, r->filename, r->line_no, "Relative jump to \'%s\' out of range!", l->string);
+}
+
+/**
+ * Fills in an adress at a byte position of the output, as a relative jump 
+ * offset or as 16 bit adress. Returns 0 if a relative jump does not reach it.
+ */
+int patch_ref(build_t *b, unsigned int pos, char relative, unsigned int adress)
+{
+	if(relative)
+	{
+		int rel = (int)adress - (int)pos - 1;
+		if(rel < -0x80 || rel > 0x7F)
+			return 0;
+		if(!b->check)
+			b->out[pos] = rel;
+	}
+	else if(!b->check)
+	{
+		b->out[pos] = adress & 0xFF;
+		b->out[pos+1] = (adress >> 8) & 0xFF;
+	}
+	return 1;
+}
+
+/**
+ * Prints a filename for a makefile rule, escaping spaces and $.
+ */
+void print_make_name(FILE *f, const char *str)
+{
+	for(; *str; ++str)
+	{
+		if(*str == ' ' || *str == '#')
+			fputc('\\', f);
+		else if(*str == '$')
+			fputc('$', f);
+		fputc(*str, f);
+	}
+}
+
+/**
+ * Writes a makefile rule with the files read by a build as prerequisites of
+ * target. With phony set, an empty rule is added for every included file so
+ * make does not fail after one is removed. The file is written under a 
+ * temporary name and then renamed, so readers never see half a file. Returns
+ * 0 on failure.
+ */
+int write_depfile(build_t *b, char *filename, char *target, int phony)
+{
+	char tmp_name[INCL_FLEN + 8];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", filename);
+	FILE *f = fopen(tmp_name, "w");
+	if(f == NULL)
+		return 0;
+	
+	unsigned int i;
+	print_make_name(f, target);
+	fputc(':', f);
+	for(i = 0; i < b->dep_no; ++i)
+	{
+		if(strcmp(b->deps[i]->name, "-") == 0)
+			continue;
+		fputs(" \\\n ", f);
+		print_make_name(f, b->deps[i]->name);
+	}
+	fputc('\n', f);
+	
+	// The first file is the input, which make knows about already
+	for(i = 1; phony && i < b->dep_no; ++i)
+	{
+		fputc('\n', f);
+		print_make_name(f, b->deps[i]->name);
+		fputs(":\n", f);
+	}
+	
+	if(fclose(f) != 0 || rename(tmp_name, filename) != 0)
+	{
+		remove(tmp_name);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Reads a whole binary file. Returns NULL if it cannot be opened.
+ */
+unsigned char *read_binary(char *filename, unsigned int *len)
+{
+	FILE *input = fopen(filename, "rb");
+	if(input == NULL)
+		return NULL;
+	
+	unsigned int max = IN_BUFLEN;
+	unsigned char *data = (unsigned char*)malloc(max);
+	size_t n;
+	*len = 0;
+	while((n = fread(data + *len, 1, max - *len, input)) > 0)
+	{
+		*len += n;
+		if(*len == max)
+		{
+			max *= 2;
+			data = (unsigned char*)realloc(data, max);
+		}
+	}
+	fclose(input);
+	return data;
+}
+
+/**
+ * Finds the ranges of the assembled binary that differ from old. Ranges less
+ * than RANGE_GAP bytes apart are joined. Returns the amount of ranges.
+ */
+unsigned int diff_ranges(build_t *b, unsigned char *old, unsigned int old_no, 
+						 range_t **ranges)
+{
+	unsigned int range_no = 0, i = 0;
+	*ranges = NULL;
+	while(i < b->out_no)
+	{
+		if(i < old_no && old[i] == b->out[i])
+		{
+			++i;
+			continue;
+		}
+		unsigned int last = i;
+		if(range_no % 64 == 0)
+			*ranges = (range_t*)realloc(*ranges, sizeof(range_t) * (range_no + 64));
+		(*ranges)[range_no].start = i;
+		for(++i; i < b->out_no && i - last <= RANGE_GAP; ++i)
+			if(i >= old_no || old[i] != b->out[i])
+				last = i;
+		(*ranges)[range_no++].end = last + 1;
+		i = last + 1;
+	}
+	return range_no;
+}
+
+/**
+ * Writes an IPS patch that turns old into the assembled binary. Returns 0 if
+ * it cannot be written, or if the binary is too large for IPS.
+ */
+int write_ips(build_t *b, char *filename, unsigned int old_no, range_t *ranges, 
+			  unsigned int range_no)
+{
+	char tmp_name[INCL_FLEN + 8];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", filename);
+	FILE *f = fopen(tmp_name, "wb");
+	if(f == NULL)
+		return 0;
+	
+	int ok = 1;
+	unsigned int i;
+	fputs("PATCH", f);
+	for(i = 0; i < range_no && ok; ++i)
+	{
+		unsigned int start = ranges[i].start;
+		// An offset of 0x454F46 would read as "EOF", start a byte earlier
+		if(start == 0x454F46)
+			--start;
+		while(start < ranges[i].end)
+		{
+			unsigned int size = ranges[i].end - start;
+			if(size > IPS_MAX_SIZE)
+				size = IPS_MAX_SIZE;
+			if(start > IPS_MAX_OFFSET)
+			{
+				ok = 0;
+				break;
+			}
+			unsigned char head[5] = {start >> 16, start >> 8, start, size >> 8, size};
+			fwrite(head, 1, 5, f);
+			fwrite(b->out + start, 1, size, f);
+			start += size;
+		}
+	}
+	fputs("EOF", f);
+	// Truncate extension, for a binary that got smaller
+	if(b->out_no < old_no)
+	{
+		unsigned char size[3] = {b->out_no >> 16, b->out_no >> 8, b->out_no};
+		fwrite(size, 1, 3, f);
+	}
+	
+	if(fclose(f) != 0 || !ok || rename(tmp_name, filename) != 0)
+	{
+		remove(tmp_name);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Writes the assembled binary to filename. With --update only the ranges that
+ * differ from the file on disk are written, so emulators and other tools that
+ * reload the file have less to do and the file stays the same file. With 
+ * --ips a patch from the old file to the new one is written to filename.ips.
+ * Returns the amount of bytes written, or -1 on error.
+ */
+long write_output(build_t *b, char *filename, options_t *opt)
+{
+	unsigned char *old = NULL;
+	unsigned int old_no = 0, range_no = 0, i;
+	range_t *ranges = NULL;
+	long written = 0;
+	
+	// - writes to stdout, e.g. into a pipe
+	if(strcmp(filename, "-") == 0)
+	{
+		if(fwrite(b->out, 1, b->out_no, stdout) != b->out_no || fflush(stdout) != 0)
+		{
+			fprintf(b->msg, "Unable to write to stdout!\n");
+			return -1;
+		}
+		return b->out_no;
+	}
+	
+	if(opt->update || opt->ips)
+	{
+		old = read_binary(filename, &old_no);
+		range_no = diff_ranges(b, old, old_no, &ranges);
+	}
+	if(opt->ips)
+	{
+		char ips_name[INCL_FLEN + 4];
+		snprintf(ips_name, sizeof(ips_name), "%s.ips", filename);
+		if(!write_ips(b, ips_name, old_no, ranges, range_no))
+			fprintf(b->msg, "Unable to write \'%s\'!\n", ips_name);
+	}
+	
+	// A binary that got smaller is written completely
+	FILE *output = NULL;
+	if(opt->update && old != NULL && b->out_no >= old_no)
+		output = fopen(filename, "r+b");
+	if(output != NULL)
+	{
+		for(i = 0; i < range_no && written >= 0; ++i)
+		{
+			unsigned int size = ranges[i].end - ranges[i].start;
+			if(fseek(output, ranges[i].start, SEEK_SET) != 0 
+			   || fwrite(b->out + ranges[i].start, 1, size, output) != size)
+				written = -1;
+			else
+				written += size;
+		}
+	}
+	else
+	{
+		output = fopen(filename, "wb");
+		if(output == NULL)
+		{
+			fprintf(b->msg, "Unable to create \'%s\'!\n", filename);
+			written = -1;
+			goto exit;
+		}
+		if(fwrite(b->out, 1, b->out_no, output) != b->out_no)
+			written = -1;
+		else
+			written = b->out_no;
+	}
+	if(fclose(output) != 0)
+		written = -1;
+	if(written < 0)
+		fprintf(b->msg, "Unable to write \'%s\'!\n", filename);
+	
+exit:
+	free(old);
+	free(ranges);
+	return written;
+}
+
+/**
+ * Finds the routine holding a byte position, routines are sorted. Returns -1
+ * for a position before the first routine.
+ */
+int find_routine(routine_t *r, unsigned int routine_no, unsigned int pos)
+{
+	int lo = 0, hi = (int)routine_no - 1, found = -1;
+	while(lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		if(r[mid].start <= pos)
+		{
+			found = mid;
+			lo = mid + 1;
+		}
+		else
+			hi = mid - 1;
+	}
+	return (found >= 0 && pos < r[found].end) ? found : -1;
+}
+
+int cmp_routine(const void *a, const void *b)
+{
+	unsigned int sa = ((const routine_t*)a)->start, sb = ((const routine_t*)b)->start;
+	return (sa > sb) - (sa < sb);
+}
+
+int cmp_edge(const void *a, const void *b)
+{
+	unsigned long ca = ((const edge_t*)a)->count, cb = ((const edge_t*)b)->count;
+	return (ca < cb) - (ca > cb);
+}
+
+// Sorted by executions per byte, the most first
+int cmp_hot(const void *a, const void *b)
+{
+	const routine_t *ra = *(const routine_t**)a, *rb = *(const routine_t**)b;
+	double ha = (double)ra->count / (ra->end - ra->start + 1);
+	double hb = (double)rb->count / (rb->end - rb->start + 1);
+	return (ha < hb) - (ha > hb);
+}
+
+/**
+ * Splits the assembled code in routines: from a named label up to the next 
+ * one, sorted by adress. Named labels at the same adress are one routine.
+ * Routines end where the used part of their bank does, the free room of each
+ * bank (the zero filled space at its end) is returned in room.
+ */
+routine_t *find_routines(build_t *b, unsigned int *routine_no, unsigned int **room)
+{
+	unsigned int i, j;
+	routine_t *r = (routine_t*)malloc(sizeof(routine_t) * (b->labels.no + 1));
+	*routine_no = 0;
+	for(i = 0; i < b->labels.no; ++i)
+	{
+		if(b->labels.list[i].pointsto == (unsigned int)-1 || is_var(b, b->labels.list[i].string))
+			continue;
+		r[*routine_no].label = &b->labels.list[i];
+		r[*routine_no].start = b->labels.list[i].pointsto;
+		r[*routine_no].count = 0;
+		r[*routine_no].switches = 0;
+		(*routine_no)++;
+	}
+	qsort(r, *routine_no, sizeof(routine_t), cmp_routine);
+	for(i = 0, j = 0; i < *routine_no; ++i)
+		if(j == 0 || r[i].start != r[j-1].start)
+			r[j++] = r[i];
+	*routine_no = j;
+	
+	unsigned int bank_no = (b->out_no + BANK_SIZE - 1) / BANK_SIZE;
+	*room = (unsigned int*)calloc(bank_no + 1, sizeof(unsigned int));
+	for(i = 0; i < bank_no; ++i)
+	{
+		unsigned int end = (i + 1) * BANK_SIZE;
+		unsigned int used = end < b->out_no ? end : b->out_no;
+		while(used > i * BANK_SIZE && b->out[used-1] == 0)
+			--used;
+		(*room)[i] = end - used;
+	}
+	for(i = 0; i < *routine_no; ++i)
+	{
+		r[i].bank = r[i].new_bank = r[i].start / BANK_SIZE;
+		r[i].end = (r[i].bank + 1) * BANK_SIZE - (*room)[r[i].bank];
+		if(i + 1 < *routine_no && r[i+1].start < r[i].end)
+			r[i].end = r[i+1].start;
+		if(r[i].end < r[i].start)
+			r[i].end = r[i].start;
+	}
+	return r;
+}
+
+/**
+ * Counts the bank switches of the profile, with the current banks of the 
+ * routines or the suggested ones. A trace of samples is replayed, switching
+ * whenever a sample lies in another switchable bank than the one mapped. 
+ * Without a trace every edge between two switchable banks counts twice (there
+ * and back).
+ */
+unsigned long count_switches(routine_t *r, edge_t *edges, unsigned int edge_no,
+							 int *samples, unsigned long sample_no, int suggested)
+{
+	unsigned long switches = 0, i;
+	if(sample_no > 0)
+	{
+		unsigned int mapped = 1;
+		for(i = 0; i < sample_no; ++i)
+		{
+			if(samples[i] < 0)
+				continue;
+			unsigned int bank = suggested ? r[samples[i]].new_bank : r[samples[i]].bank;
+			if(bank != 0 && bank != mapped)
+			{
+				++switches;
+				mapped = bank;
+			}
+		}
+		return switches;
+	}
+	for(i = 0; i < edge_no; ++i)
+	{
+		unsigned int from = suggested ? r[edges[i].from].new_bank : r[edges[i].from].bank;
+		unsigned int to = suggested ? r[edges[i].to].new_bank : r[edges[i].to].bank;
+		if(from != 0 && to != 0 && from != to)
+			switches += 2 * edges[i].count;
+	}
+	return switches;
+}
+
+/**
+ * Reads an execution profile exported by an emulator and reports where the 
+ * executed routines (code from a named label up to the next one) should go to
+ * save bank switches: the hottest ones into bank 0 as far as there is room,
+ * and routines that call each other into the same bank. The profile holds
+ * one entry per line, either a label name with its execution count, or a 
+ * sampled PC as bank:adress or as ROM offset (hexadecimal). Samples are taken 
+ * to be in the order they were executed. Free room of a bank is the zero 
+ * filled space at its end. Returns 0 if the profile cannot be read.
+ */
+int profile_layout(build_t *b, char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	if(f == NULL)
+		return 0;
+	
+	unsigned int routine_no, i, *room;
+	routine_t *r = find_routines(b, &routine_no, &room);
+	
+	// Read the profile, samples are kept as routine indices for the replay
+	char buf[IN_BUFLEN], name[IN_BUFLEN];
+	int *samples = NULL;
+	unsigned long sample_no = 0, sample_max = 0, count;
+	unsigned int bank, adress;
+	while(fgets(buf, sizeof(buf), f) != NULL)
+	{
+		char *p = buf;
+		while(*p == ' ' || *p == '\t')
+			++p;
+		if(*p == '#' || *p == '\n' || *p == 0)
+			continue;
+		int n = -1;
+		if(sscanf(p, "%x:%x", &bank, &adress) == 2)
+			n = find_routine(r, routine_no, bank * BANK_SIZE + (adress >= BANK_SIZE ? adress - BANK_SIZE : adress));
+		else if(sscanf(p, "%s %lu", name, &count) == 2)
+		{
+			strtoupper(name);
+			for(i = 0; i < routine_no && strcmp(r[i].label->string, name) != 0; ++i);
+			if(i < routine_no)
+				r[i].count += count;
+			continue;
+		}
+		else if(sscanf(p, "%x", &adress) == 1)
+			n = find_routine(r, routine_no, adress);
+		else
+			continue;
+		if(sample_no == sample_max)
+		{
+			sample_max = sample_max ? sample_max * 2 : 1024;
+			samples = (int*)realloc(samples, sizeof(int) * sample_max);
+		}
+		samples[sample_no++] = n;
+		if(n >= 0)
+			r[n].count++;
+	}
+	fclose(f);
+	
+	// Edges: the order of the trace, or else the label references weighted 
+	// by the count of the target, split over its callers
+	edge_t *edges = NULL;
+	unsigned int edge_no = 0, edge_max = 0;
+	unsigned int *callers = (unsigned int*)calloc(routine_no + 1, sizeof(unsigned int));
+	for(i = 0; i < b->labels.no; ++i)
+	{
+		label_t *l = &b->labels.list[i];
+		label_ref_t *ref;
+		int to = (l->pointsto == (unsigned int)-1) ? -1 : find_routine(r, routine_no, l->pointsto);
+		for(ref = l->refs; ref != NULL && to >= 0; ref = ref->next)
+		{
+			int from = find_routine(r, routine_no, ref->pos);
+			if(from < 0 || from == to)
+				continue;
+			if(edge_no == edge_max)
+			{
+				edge_max = edge_max ? edge_max * 2 : 256;
+				edges = (edge_t*)realloc(edges, sizeof(edge_t) * edge_max);
+			}
+			edges[edge_no].from = from;
+			edges[edge_no].to = to;
+			edges[edge_no++].count = 0;
+			callers[to]++;
+		}
+	}
+	for(i = 0; i < edge_no; ++i)
+	{
+		if(sample_no == 0)
+			edges[i].count = r[edges[i].to].count / callers[edges[i].to];
+		else
+		{
+			// Calls and jumps seen in the trace
+			unsigned long k;
+			for(k = 1; k < sample_no; ++k)
+				if(samples[k-1] == (int)edges[i].from && samples[k] == (int)edges[i].to)
+					edges[i].count++;
+		}
+	}
+	qsort(edges, edge_no, sizeof(edge_t), cmp_edge);
+	
+	// Hottest routines first into bank 0
+	routine_t **hot = (routine_t**)malloc(sizeof(routine_t*) * (routine_no + 1));
+	unsigned int hot_no = 0;
+	for(i = 0; i < routine_no; ++i)
+		if(r[i].count > 0 && r[i].bank != 0)
+			hot[hot_no++] = &r[i];
+	qsort(hot, hot_no, sizeof(routine_t*), cmp_hot);
+	for(i = 0; i < hot_no; ++i)
+	{
+		unsigned int size = hot[i]->end - hot[i]->start;
+		if(size <= room[0])
+		{
+			hot[i]->new_bank = 0;
+			room[0] -= size;
+			room[hot[i]->bank] += size;
+		}
+	}
+	// Then routines that call each other into the same bank
+	for(i = 0; i < edge_no && edges[i].count > 0; ++i)
+	{
+		routine_t *from = &r[edges[i].from], *to = &r[edges[i].to];
+		if(from->new_bank == 0 || to->new_bank == 0 || from->new_bank == to->new_bank)
+			continue;
+		routine_t *move = (to->end - to->start <= from->end - from->start) ? to : from;
+		routine_t *stay = (move == to) ? from : to;
+		unsigned int size = move->end - move->start;
+		if(size <= room[stay->new_bank])
+		{
+			room[stay->new_bank] -= size;
+			room[move->new_bank] += size;
+			move->new_bank = stay->new_bank;
+		}
+	}
+	
+	unsigned int executed = 0, moved = 0;
+	for(i = 0; i < routine_no; ++i)
+		executed += r[i].count > 0;
+	fprintf(b->msg, "Profile \'%s\': %lu sample%s, %u of %u routines executed.\n", 
+			filename, sample_no, sample_no != 1 ? "s" : "", executed, routine_no);
+	for(i = 0; i < routine_no; ++i)
+	{
+		if(r[i].new_bank == r[i].bank)
+			continue;
+		if(moved++ == 0)
+			fprintf(b->msg, "Suggested layout:\n");
+		fprintf(b->msg, "  %s: bank %u -> bank %u (%lu executions, %u bytes)\n", 
+				r[i].label->string, r[i].bank, r[i].new_bank, r[i].count, 
+				r[i].end - r[i].start);
+	}
+	unsigned long before = count_switches(r, edges, edge_no, samples, sample_no, 0);
+	unsigned long after = count_switches(r, edges, edge_no, samples, sample_no, 1);
+	if(moved == 0)
+		fprintf(b->msg, "No routines to move, %lu bank switch%s estimated.\n", before,
+				before != 1 ? "es" : "");
+	else
+		fprintf(b->msg, "Estimated bank switches: %lu -> %lu, about %lu cycles saved.\n",
+				before, after, before > after ? (before - after) * SWITCH_CYCLES : 0);
+	
+	free(r);
+	free(room);
+	free(samples);
+	free(edges);
+	free(callers);
+	free(hot);
+	return 1;
+}
+
+/**
+ * Kind of a jump or call by its opcode, NULL if it is not one.
+ */
+const char *jump_kind(unsigned char op)
+{
+	switch(op)
+	{
+		case 0xCD: case 0xC4: case 0xCC: case 0xD4: case 0xDC:
+			return "call";
+		case 0xC3: case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+			return "jp";
+		case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+			return "jr";
+	}
+	if((op & 0xC7) == 0xC7)
+		return "rst";
+	return NULL;
+}
+
+/**
+ * Prints the static call graph: every CALL, JP and JR to a named label, and 
+ * every RST, per routine with its bank. Edges into another switchable bank 
+ * are flagged as crossing banks (they only work when the program switched 
+ * already), calls of a bank 0 routine that writes the bank register as going
+ * through a trampoline. Each gets an estimate of its extra cycles. Printed 
+ * if print is set, and written as JSON to json_name if not NULL. Returns 0 if
+ * the JSON file cannot be written.
+ */
+int call_graph(build_t *b, int print, char *json_name)
+{
+	unsigned int routine_no, *room, i, k;
+	routine_t *r = find_routines(b, &routine_no, &room);
+	
+	for(i = 0; i < b->site_no; ++i)
+	{
+		int n = find_routine(r, routine_no, b->sites[i].pos);
+		if(n >= 0 && b->sites[i].op == 0xEA)
+			r[n].switches++;
+	}
+	
+	// Edges from the label references and the RST instructions
+	edge_t *edges = NULL;
+	unsigned int edge_no = 0, edge_max = 0;
+	unsigned int *site = NULL;	// Byte position of each edge
+	const char **kind = NULL;
+	for(i = 0; i < b->labels.no + b->site_no; ++i)
+	{
+		label_ref_t rst, *ref;
+		unsigned int target;
+		if(i < b->labels.no)
+		{
+			if(b->labels.list[i].pointsto == (unsigned int)-1)
+				continue;
+			target = b->labels.list[i].pointsto;
+			ref = b->labels.list[i].refs;
+		}
+		else
+		{
+			site_t *s = &b->sites[i - b->labels.no];
+			if(s->op == 0xEA)
+				continue;
+			rst.pos = s->pos;
+			rst.op = s->op;
+			rst.next = NULL;
+			target = s->op & 0x38;
+			ref = &rst;
+		}
+		int to = find_routine(r, routine_no, target);
+		for(; ref != NULL && to >= 0; ref = ref->next)
+		{
+			int from = find_routine(r, routine_no, ref->pos);
+			const char *k = jump_kind(ref->op);
+			if(from < 0 || k == NULL || (from == to && *k != 'r'))
+				continue;
+			if(edge_no == edge_max)
+			{
+				edge_max = edge_max ? edge_max * 2 : 256;
+				edges = (edge_t*)realloc(edges, sizeof(edge_t) * edge_max);
+				site = (unsigned int*)realloc(site, sizeof(unsigned int) * edge_max);
+				kind = (const char**)realloc(kind, sizeof(const char*) * edge_max);
+			}
+			edges[edge_no].from = from;
+			edges[edge_no].to = to;
+			site[edge_no] = ref->pos;
+			kind[edge_no] = k;
+			// Extra cycles of the edge
+			routine_t *t = &r[to];
+			if(r[from].bank != t->bank && t->bank != 0)
+				edges[edge_no].count = (*k == 'c' || *k == 'r') ? 2 * SWITCH_CYCLES : SWITCH_CYCLES;
+			else if(t->bank == 0 && t->switches > 0)
+				edges[edge_no].count = FAR_CALL_CYCLES;
+			else
+				edges[edge_no].count = 0;
+			edge_no++;
+		}
+	}
+	
+	FILE *json = NULL;
+	if(json_name != NULL)
+	{
+		json = fopen(json_name, "w");
+		if(json == NULL)
+		{
+			free(r);
+			free(room);
+			free(edges);
+			free(site);
+			free(kind);
+			return 0;
+		}
+		fprintf(json, "{\"routines\":[");
+	}
+	
+	unsigned int crossing = 0, trampolines = 0, first = 1;
+	unsigned long cycles = 0;
+	if(print)
+		fprintf(b->msg, "Call graph:\n");
+	for(i = 0; i < routine_no; ++i)
+	{
+		if(json != NULL)
+		{
+			fprintf(json, "%s\n{\"name\":", first ? "" : ",");
+			print_json_string(json, r[i].label->string);
+			fprintf(json, ",\"bank\":%u,\"adress\":%u,\"size\":%u,\"bank_switches\":%u,\"calls\":[",
+					r[i].bank, r[i].start, r[i].end - r[i].start, r[i].switches);
+			first = 0;
+		}
+		unsigned int shown = 0;
+		for(k = 0; k < edge_no; ++k)
+		{
+			if(edges[k].from != i)
+				continue;
+			routine_t *t = &r[edges[k].to];
+			int cross = r[i].bank != t->bank && t->bank != 0;
+			int trampoline = !cross && t->bank == 0 && t->switches > 0;
+			crossing += cross;
+			trampolines += trampoline;
+			cycles += edges[k].count;
+			if(print)
+			{
+				if(shown == 0)
+					fprintf(b->msg, "%s (bank %u, 0x%X)\n", r[i].label->string, r[i].bank, r[i].start);
+				fprintf(b->msg, "  %s %s (bank %u) at 0x%X%s%s", kind[k], t->label->string, 
+						t->bank, site[k], cross ? ", crosses banks" : "", 
+						trampoline ? ", through trampoline" : "");
+				if(edges[k].count > 0)
+					fprintf(b->msg, ", ~%lu cycles", edges[k].count);
+				fputc('\n', b->msg);
+			}
+			if(json != NULL)
+			{
+				fprintf(json, "%s{\"to\":", shown ? "," : "");
+				print_json_string(json, t->label->string);
+				fprintf(json, ",\"kind\":\"%s\",\"bank\":%u,\"site\":%u,\"cross_bank\":%s,"
+						"\"trampoline\":%s,\"cycles\":%lu}", kind[k], t->bank, site[k], 
+						cross ? "true" : "false", trampoline ? "true" : "false", edges[k].count);
+			}
+			++shown;
+		}
+		if(json != NULL)
+			fprintf(json, "]}");
+	}
+	if(print)
+		fprintf(b->msg, "%u edge%s, %u crossing banks, %u through trampolines, "
+				"~%lu cycles overhead if each is taken once.\n", edge_no, 
+				edge_no != 1 ? "s" : "", crossing, trampolines, cycles);
+	
+	int ok = 1;
+	if(json != NULL)
+	{
+		fprintf(json, "\n],\"edges\":%u,\"cross_bank\":%u,\"trampoline\":%u,\"cycles\":%lu}\n",
+				edge_no, crossing, trampolines, cycles);
+		ok = fclose(json) == 0;
+	}
+	free(r);
+	free(room);
+	free(edges);
+	free(site);
+	free(kind);
+	return ok;
+}
+
+/**
+ * Reads a byte as the CPU of --run sees it: 4000-7FFF shows the selected ROM
+ * bank, adresses past the end of the ROM read FF.
+ */
+unsigned char cpu_read(cpu_t *c, unsigned int adress)
+{
+	adress &= 0xFFFF;
+	if(adress >= 0x8000)
+		return c->mem[adress];
+	if(adress >= BANK_SIZE)
+		adress += (c->bank - 1) * BANK_SIZE;
+	return adress < c->rom_len ? c->rom[adress] : 0xFF;
+}
+
+/**
+ * Writes a byte as the CPU of --run does. Writes to 2000-3FFF select the ROM
+ * bank (the whole byte, as on MBC5), other writes to ROM are ignored.
+ */
+void cpu_write(cpu_t *c, unsigned int adress, unsigned char value)
+{
+	adress &= 0xFFFF;
+	if(adress >= 0x8000)
+		c->mem[adress] = value;
+	else if(adress >= 0x2000 && adress < 0x4000)
+		c->bank = value ? value : 1;
+}
+
+unsigned char cpu_fetch(cpu_t *c)
+{
+	unsigned char value = cpu_read(c, c->pc);
+	c->pc = (c->pc + 1) & 0xFFFF;
+	return value;
+}
+
+unsigned int cpu_fetch16(cpu_t *c)
+{
+	unsigned int value = cpu_fetch(c);
+	return value | (cpu_fetch(c) << 8);
+}
+
+void cpu_push(cpu_t *c, unsigned int value)
+{
+	c->sp = (c->sp - 1) & 0xFFFF;
+	cpu_write(c, c->sp, value >> 8);
+	c->sp = (c->sp - 1) & 0xFFFF;
+	cpu_write(c, c->sp, value & 0xFF);
+}
+
+unsigned int cpu_pop(cpu_t *c)
+{
+	unsigned int value = cpu_read(c, c->sp) | (cpu_read(c, c->sp + 1) << 8);
+	c->sp = (c->sp + 2) & 0xFFFF;
+	return value;
+}
+
+/**
+ * Register i in the order of the opcodes: B, C, D, E, H, L, (HL), A.
+ */
+unsigned char cpu_get_r(cpu_t *c, int i)
+{
+	return i == 6 ? cpu_read(c, (c->r[4] << 8) | c->r[5]) : c->r[i];
+}
+
+void cpu_set_r(cpu_t *c, int i, unsigned char value)
+{
+	if(i == 6)
+		cpu_write(c, (c->r[4] << 8) | c->r[5], value);
+	else
+		c->r[i] = value;
+}
+
+/**
+ * Register pair p in the order of the opcodes: BC, DE, HL, SP.
+ */
+unsigned int cpu_get_pair(cpu_t *c, int p)
+{
+	return p == 3 ? c->sp : (unsigned int)(c->r[p*2] << 8 | c->r[p*2+1]);
+}
+
+void cpu_set_pair(cpu_t *c, int p, unsigned int value)
+{
+	value &= 0xFFFF;
+	if(p == 3)
+		c->sp = value;
+	else
+	{
+		c->r[p*2] = value >> 8;
+		c->r[p*2+1] = value & 0xFF;
+	}
+}
+
+/**
+ * Condition cc of a jump, call or return: NZ, Z, NC, C.
+ */
+int cpu_cond(cpu_t *c, int cc)
+{
+	int set = (c->r[6] & (cc < 2 ? FLAG_Z : FLAG_C)) != 0;
+	return (cc & 1) ? set : !set;
+}
+
+/**
+ * Arithmetic operation op on A and value, in the order of the opcodes: ADD, 
+ * ADC, SUB, SBC, AND, XOR, OR, CP.
+ */
+void cpu_alu(cpu_t *c, int op, unsigned int value)
+{
+	unsigned int a = c->r[7], carry = (c->r[6] & FLAG_C) ? 1 : 0, res, f;
+	switch(op)
+	{
+		case 0:
+			carry = 0;
+			// Fall through
+		case 1:
+			res = a + value + carry;
+			f = ((a & 0xF) + (value & 0xF) + carry > 0xF ? FLAG_H : 0) | (res > 0xFF ? FLAG_C : 0);
+			break;
+		case 2: case 7:
+			carry = 0;
+			// Fall through
+		case 3:
+			res = a - value - carry;
+			f = FLAG_N | ((a & 0xF) < (value & 0xF) + carry ? FLAG_H : 0) 
+				| (a < value + carry ? FLAG_C : 0);
+			break;
+		case 4:
+			res = a & value;
+			f = FLAG_H;
+			break;
+		case 5:
+			res = a ^ value;
+			f = 0;
+			break;
+		default:
+			res = a | value;
+			f = 0;
+	}
+	res &= 0xFF;
+	c->r[6] = f | (res == 0 ? FLAG_Z : 0);
+	if(op != 7)
+		c->r[7] = res;
+}
+
+/**
+ * Shifts and rotates value by op in the order of the opcodes: RLC, RRC, RL, 
+ * RR, SLA, SRA, SWAP, SRL. The carry flag goes in and out through carry.
+ */
+unsigned int cpu_shift(int op, unsigned int value, unsigned int *carry)
+{
+	switch(op)
+	{
+		case 0: *carry = value >> 7; value = (value << 1) | *carry; break;
+		case 1: *carry = value & 1; value = (value >> 1) | (*carry << 7); break;
+		case 2: value = (value << 1) | *carry; *carry = value >> 8; break;
+		case 3: value |= *carry << 8; *carry = value & 1; value >>= 1; break;
+		case 4: *carry = value >> 7; value <<= 1; break;
+		case 5: *carry = value & 1; value = (value >> 1) | (value & 0x80); break;
+		case 6: *carry = 0; value = (value << 4) | (value >> 4); break;
+		default: *carry = value & 1; value >>= 1;
+	}
+	return value & 0xFF;
+}
+
+/**
+ * Runs an instruction with the CB prefix, returns its cycles.
+ */
+int cpu_step_cb(cpu_t *c)
+{
+	unsigned int op = cpu_fetch(c), y = (op >> 3) & 7, z = op & 7;
+	unsigned int value = cpu_get_r(c, z), carry = (c->r[6] & FLAG_C) ? 1 : 0;
+	switch(op >> 6)
+	{
+		case 0:
+			value = cpu_shift(y, value, &carry);
+			c->r[6] = (value == 0 ? FLAG_Z : 0) | (carry ? FLAG_C : 0);
+			break;
+		case 1:
+			c->r[6] = (c->r[6] & FLAG_C) | FLAG_H | ((value >> y) & 1 ? 0 : FLAG_Z);
+			return z == 6 ? 12 : 8;
+		case 2:
+			value &= ~(1 << y);
+			break;
+		default:
+			value |= 1 << y;
+	}
+	cpu_set_r(c, z, value);
+	return z == 6 ? 16 : 8;
+}
+
+/**
+ * Runs the instruction at PC. Returns its cycles (taken branches included), 
+ * or 0 for an opcode that does not exist, with PC left on it. HALT and STOP 
+ * set halted, as there are no interrupts to wake up from.
+ */
+int cpu_step(cpu_t *c)
+{
+	unsigned int op = cpu_fetch(c), value, carry = (c->r[6] & FLAG_C) ? 1 : 0;
+	unsigned int hl = cpu_get_pair(c, 2);
+	int x = op >> 6, y = (op >> 3) & 7, z = op & 7, p = y >> 1, q = y & 1;
+	signed char d;
+	
+	if(x == 1)
+	{
+		if(op == 0x76)
+		{
+			c->halted = 1;
+			return 4;
+		}
+		cpu_set_r(c, y, cpu_get_r(c, z));
+		return (y == 6 || z == 6) ? 8 : 4;
+	}
+	if(x == 2)
+	{
+		cpu_alu(c, y, cpu_get_r(c, z));
+		return z == 6 ? 8 : 4;
+	}
+	if(x == 0)
+	{
+		switch(z)
+		{
+			case 0:
+				if(y == 0)
+					return 4;
+				if(y == 1)
+				{
+					value = cpu_fetch16(c);
+					cpu_write(c, value, c->sp & 0xFF);
+					cpu_write(c, value + 1, c->sp >> 8);
+					return 20;
+				}
+				if(y == 2)
+				{
+					cpu_fetch(c);
+					c->halted = 1;
+					return 4;
+				}
+				// JR, JR cc
+				d = cpu_fetch(c);
+				if(y > 3 && !cpu_cond(c, y - 4))
+					return 8;
+				c->pc = (c->pc + d) & 0xFFFF;
+				return 12;
+			case 1:
+				if(q == 0)
+				{
+					cpu_set_pair(c, p, cpu_fetch16(c));
+					return 12;
+				}
+				// ADD HL,rr
+				value = cpu_get_pair(c, p);
+				c->r[6] = (c->r[6] & FLAG_Z) | ((hl & 0xFFF) + (value & 0xFFF) > 0xFFF ? FLAG_H : 0)
+						  | (hl + value > 0xFFFF ? FLAG_C : 0);
+				cpu_set_pair(c, 2, hl + value);
+				return 8;
+			case 2:
+				// LD (BC),A, LD (DE),A, LD (HL+),A, LD (HL-),A and the other way
+				value = p < 2 ? cpu_get_pair(c, p) : hl;
+				if(p == 2)
+					cpu_set_pair(c, 2, hl + 1);
+				else if(p == 3)
+					cpu_set_pair(c, 2, hl - 1);
+				if(q == 0)
+					cpu_write(c, value, c->r[7]);
+				else
+					c->r[7] = cpu_read(c, value);
+				return 8;
+			case 3:
+				cpu_set_pair(c, p, q ? cpu_get_pair(c, p) - 1 : cpu_get_pair(c, p) + 1);
+				return 8;
+			case 4: case 5:
+				// INC r, DEC r
+				value = (z == 4 ? cpu_get_r(c, y) + 1 : cpu_get_r(c, y) - 1) & 0xFF;
+				c->r[6] = (c->r[6] & FLAG_C) | (value == 0 ? FLAG_Z : 0) | (z == 5 ? FLAG_N : 0)
+						  | ((value & 0xF) == (z == 4 ? 0 : 0xF) ? FLAG_H : 0);
+				cpu_set_r(c, y, value);
+				return y == 6 ? 12 : 4;
+			case 6:
+				cpu_set_r(c, y, cpu_fetch(c));
+				return y == 6 ? 12 : 8;
+		}
+		value = c->r[7];
+		switch(y)
+		{
+			case 4:
+				// DAA
+				if(!(c->r[6] & FLAG_N))
+				{
+					if(carry || value > 0x99)
+					{
+						value += 0x60;
+						carry = 1;
+					}
+					if((c->r[6] & FLAG_H) || (value & 0xF) > 9)
+						value += 6;
+				}
+				else
+				{
+					if(carry)
+						value -= 0x60;
+					if(c->r[6] & FLAG_H)
+						value -= 6;
+				}
+				value &= 0xFF;
+				c->r[7] = value;
+				c->r[6] = (c->r[6] & FLAG_N) | (value == 0 ? FLAG_Z : 0) | (carry ? FLAG_C : 0);
+				return 4;
+			case 5:
+				c->r[7] = ~value;
+				c->r[6] |= FLAG_N | FLAG_H;
+				return 4;
+			case 6:
+				c->r[6] = (c->r[6] & FLAG_Z) | FLAG_C;
+				return 4;
+			case 7:
+				c->r[6] = (c->r[6] & (FLAG_Z | FLAG_C)) ^ FLAG_C;
+				return 4;
+		}
+		// RLCA, RRCA, RLA, RRA clear Z
+		c->r[7] = cpu_shift(y, value, &carry);
+		c->r[6] = carry ? FLAG_C : 0;
+		return 4;
+	}
+	
+	switch(z)
+	{
+		case 0:
+			if(y < 4)
+			{
+				if(!cpu_cond(c, y))
+					return 8;
+				c->pc = cpu_pop(c);
+				return 20;
+			}
+			if(y == 4)
+			{
+				cpu_write(c, 0xFF00 | cpu_fetch(c), c->r[7]);
+				return 12;
+			}
+			if(y == 6)
+			{
+				c->r[7] = cpu_read(c, 0xFF00 | cpu_fetch(c));
+				return 12;
+			}
+			// ADD SP,d and LD HL,SP+d
+			d = cpu_fetch(c);
+			value = (c->sp + d) & 0xFFFF;
+			c->r[6] = ((c->sp & 0xF) + (d & 0xF) > 0xF ? FLAG_H : 0) 
+					  | ((c->sp & 0xFF) + (d & 0xFF) > 0xFF ? FLAG_C : 0);
+			if(y == 5)
+			{
+				c->sp = value;
+				return 16;
+			}
+			cpu_set_pair(c, 2, value);
+			return 12;
+		case 1:
+			if(q == 0)
+			{
+				value = cpu_pop(c);
+				if(p == 3)
+				{
+					c->r[7] = value >> 8;
+					c->r[6] = value & 0xF0;
+				}
+				else
+					cpu_set_pair(c, p, value);
+				return 12;
+			}
+			if(p < 2)
+			{
+				// RET, RETI
+				c->pc = cpu_pop(c);
+				if(p == 1)
+					c->ime = 1;
+				return 16;
+			}
+			if(p == 2)
+			{
+				c->pc = hl;
+				return 4;
+			}
+			c->sp = hl;
+			return 8;
+		case 2:
+			if(y < 4)
+			{
+				value = cpu_fetch16(c);
+				if(!cpu_cond(c, y))
+					return 12;
+				c->pc = value;
+				return 16;
+			}
+			if(y == 4)
+				cpu_write(c, 0xFF00 | c->r[1], c->r[7]);
+			else if(y == 5)
+				cpu_write(c, cpu_fetch16(c), c->r[7]);
+			else if(y == 6)
+				c->r[7] = cpu_read(c, 0xFF00 | c->r[1]);
+			else
+				c->r[7] = cpu_read(c, cpu_fetch16(c));
+			return (y & 1) ? 16 : 8;
+		case 3:
+			if(y == 0)
+			{
+				c->pc = cpu_fetch16(c);
+				return 16;
+			}
+			if(y == 1)
+				return cpu_step_cb(c);
+			if(y == 6 || y == 7)
+			{
+				c->ime = y == 7;
+				return 4;
+			}
+			break;
+		case 4:
+			if(y < 4)
+			{
+				value = cpu_fetch16(c);
+				if(!cpu_cond(c, y))
+					return 12;
+				cpu_push(c, c->pc);
+				c->pc = value;
+				return 24;
+			}
+			break;
+		case 5:
+			if(q == 0)
+			{
+				cpu_push(c, p == 3 ? (unsigned int)(c->r[7] << 8 | c->r[6]) : cpu_get_pair(c, p));
+				return 16;
+			}
+			if(p == 0)
+			{
+				value = cpu_fetch16(c);
+				cpu_push(c, c->pc);
+				c->pc = value;
+				return 24;
+			}
+			break;
+		case 6:
+			cpu_alu(c, y, cpu_fetch(c));
+			return 8;
+		case 7:
+			cpu_push(c, c->pc);
+			c->pc = y * 8;
+			return 16;
+	}
+	c->pc = (c->pc - 1) & 0xFFFF;
+	return 0;
+}
+
+/**
+ * Reads a value of --run: a label, a define or a number. Hex numbers may 
+ * start with a letter, like C000, if there is no such label or define.
+ */
+int run_value(build_t *b, char *str, unsigned int *value)
 {
-	ERR_NO,
-	ERR_ARG,
-	ERR_IO,
-	ERR_SYNT
-	
-} error_e;
+	char *end;
+	size_t i;
+	if(!isdigit(*str))
+	{
+		for(i = 0; i < b->labels.no; ++i)
+			if(b->labels.list[i].pointsto != (unsigned int)-1 
+			   && strcmp(b->labels.list[i].string, str) == 0)
+			{
+				*value = b->labels.list[i].pointsto;
+				return 1;
+			}
+		define_t *def = find_define(b->defines, &b->define_no, str);
+		if(def != NULL)
+		{
+			*value = def->value;
+			return 1;
+		}
+	}
+	*value = strtoul(str, &end, 16);
+	return *str != 0 && *end == 0;
+}
 
-error_e _err = ERR_NO;
-void assemble(char *filename, FILE *input, FILE *output, 
-			  label_t labels[], size_t *label_no, unsigned int *out_no);
-void parse_file_pass1(char *filename, FILE *input, FILE *output, 
-					  label_t labels[], size_t *label_no, unsigned int *out_no);
-void parse_instr(char *str, FILE *output, unsigned int *out_no, 
-				 unsigned int *line_no, char *filename,
-				 label_t labels[], size_t *label_no);
-void parse_file_pass2(FILE *output, label_t labels[], size_t *label_no);
-unsigned char calc_checksum(FILE *INPUT);
+/**
+ * Gets (or sets if set is not 0) register or memory adress name of a --run.
+ * Returns the size of the value in bytes, 0 if name is not valid.
+ */
+int run_access(build_t *b, cpu_t *c, char *name, unsigned int *value, int set)
+{
+	const char *regs[] = { "B", "C", "D", "E", "H", "L", "F", "A" };
+	const char *pairs[] = { "BC", "DE", "HL", "SP", "AF" };
+	unsigned int adress;
+	int i;
+	size_t len = strlen(name);
+	if(*name == '(' && len > 2 && name[len-1] == ')')
+	{
+		name[len-1] = 0;
+		i = run_value(b, name + 1, &adress);
+		name[len-1] = ')';
+		if(!i)
+			return 0;
+		if(set)
+			cpu_write(c, adress, *value);
+		*value = cpu_read(c, adress);
+		return 1;
+	}
+	for(i = 0; i < 8; ++i)
+		if(strcmp(name, regs[i]) == 0)
+		{
+			if(set)
+				c->r[i] = i == 6 ? *value & 0xF0 : *value;
+			*value = c->r[i];
+			return 1;
+		}
+	for(i = 0; i < 5; ++i)
+		if(strcmp(name, pairs[i]) == 0)
+		{
+			if(set && i == 4)
+			{
+				c->r[7] = *value >> 8;
+				c->r[6] = *value & 0xF0;
+			}
+			else if(set)
+				cpu_set_pair(c, i, *value);
+			*value = i == 4 ? (unsigned int)(c->r[7] << 8 | c->r[6]) : cpu_get_pair(c, i);
+			return 2;
+		}
+	return 0;
+}
 
-int main(int argc, char **argv)
+/**
+ * Runs a routine of the built ROM for --run, spec is label[:setup[:expected]].
+ * The CPU starts out as the boot ROM of the DMG leaves it (AF=01B0, BC=0013, 
+ * DE=00D8, HL=014D, SP=FFFE) with RAM cleared and bank 1 mapped, a routine in
+ * an other bank is called with its bank mapped. Then the setup is done, and 
+ * the routine is called as by CALL. It runs until a return brings the stack 
+ * back to where it was before the call, the cycles of that return included. 
+ * Prints the result, returns 0 if the routine did not return or a value is 
+ * not as expected.
+ */
+int run_routine(build_t *b, char *spec)
 {
-	FILE *input = NULL, *output = NULL;
-	label_t *labels = NULL;
+	char buf[IN_BUFLEN], *part[3] = { NULL, NULL, NULL }, *next, *item;
+	unsigned int adress, value, expected, i;
+	int ok = 1;
 	
-	if(argc < 3)
+	snprintf(buf, sizeof(buf), "%s", spec);
+	strtoupper(buf);
+	part[0] = buf;
+	for(i = 1, next = buf; i < 3 && (next = strchr(next, ':')) != NULL; ++i)
 	{
-		printf("Usage: %s <inputfile> <outputfile>\n", argv[0]);
-		_err = ERR_ARG;
-		goto exit;
+		*next++ = 0;
+		part[i] = next;
 	}
-	
-	input = fopen(argv[1], "r");
-	if(input == NULL)
+	if(!run_value(b, part[0], &adress))
 	{
-		printf("Unable to open \'%s\'!\n", argv[1]);
-		_err = ERR_IO;
-		goto exit;
+		fprintf(b->msg, "%s: Label not found!\n", part[0]);
+		return 0;
 	}
 	
-	output = fopen(argv[2], "wb+");
-	if(output == NULL)
+	cpu_t c;
+	memset(&c, 0, sizeof(cpu_t));
+	c.mem = (unsigned char*)calloc(0x10000, 1);
+	c.rom = b->out;
+	c.rom_len = b->out_no;
+	c.bank = 1;
+	c.r[7] = 0x01;
+	c.r[6] = 0xB0;
+	c.r[1] = 0x13;
+	c.r[3] = 0xD8;
+	c.r[4] = 0x01;
+	c.r[5] = 0x4D;
+	c.sp = 0xFFFE;
+	if(adress >= 0x8000 && adress < b->out_no)
 	{
-		printf("Unable to create \'%s\'!\n", argv[2]);
-		_err = ERR_IO;
-		goto exit;
+		c.bank = adress / BANK_SIZE;
+		adress = BANK_SIZE | (adress & (BANK_SIZE - 1));
 	}
 	
-	labels = (label_t*)malloc(sizeof(label_t) * MAX_LABELS);
-	size_t label_no = 0;
-	
-	unsigned int i;
-	for(i = 0; i < MAX_LABELS; ++i)
+	// name=value,...
+	for(item = part[1]; item != NULL && *item != 0; item = next)
 	{
-		*(labels[i].string) = 0;
-		labels[i].points_no = 0;
-		labels[i].pointsto = -1;
-		labels[i].refline = -1;
+		next = strchr(item, ',');
+		if(next != NULL)
+			*next++ = 0;
+		char *eq = strchr(item, '=');
+		if(eq != NULL)
+			*eq++ = 0;
+		if(eq == NULL || !run_value(b, eq, &value) || !run_access(b, &c, item, &value, 1))
+		{
+			fprintf(b->msg, "%s: Invalid setup \'%s\'!\n", part[0], item);
+			ok = 0;
+		}
 	}
 	
-	// Amount of bytes written
-	unsigned int out_no = 0;
-	assemble(argv[1], input, output, labels, &label_no, &out_no);
+	if(!ok)
+	{
+		free(c.mem);
+		return 0;
+	}
 	
-	if(_err != ERR_NO)
-		goto exit;
+	unsigned int sp = c.sp;
+	int cycles = 0, returned = 0;
+	cpu_push(&c, c.pc);
+	c.pc = adress;
+	while(!returned && c.cycles < RUN_CYCLES && !c.halted)
+	{
+		unsigned char op = cpu_read(&c, c.pc);
+		cycles = cpu_step(&c);
+		if(cycles == 0)
+			break;
+		c.cycles += cycles;
+		c.instrs++;
+		returned = c.sp == sp && (op == 0xC9 || op == 0xD9 || (op & 0xE7) == 0xC0);
+	}
 	
-	fclose(input);
-	fclose(output);
+	if(returned)
+		fprintf(b->msg, "%s: Returned after %lu cycles, %lu instructions. AF=0x%04X "
+				"BC=0x%04X DE=0x%04X HL=0x%04X SP=0x%04X\n", part[0], c.cycles, c.instrs,
+				(c.r[7] << 8) | c.r[6], cpu_get_pair(&c, 0), cpu_get_pair(&c, 1),
+				cpu_get_pair(&c, 2), c.sp);
+	else if(cycles == 0)
+		fprintf(b->msg, "%s: Undefined opcode 0x%02X at 0x%04X after %lu cycles!\n", 
+				part[0], cpu_read(&c, c.pc), c.pc, c.cycles);
+	else if(c.halted)
+		fprintf(b->msg, "%s: Stopped by HALT or STOP at 0x%04X after %lu cycles!\n", 
+				part[0], (c.pc - 1) & 0xFFFF, c.cycles);
+	else
+		fprintf(b->msg, "%s: Did not return within %lu cycles, PC=0x%04X!\n", 
+				part[0], c.cycles, c.pc);
+	ok = returned;
 	
-	// Calculate checksum
-	input = fopen(argv[2], "rb");
-	if(input == NULL)
+	// All expected values are checked, to report every difference
+	for(item = part[2]; returned && item != NULL && *item != 0; item = next)
 	{
-		printf("Unable to open \'%s\'!\n", argv[2]);
-		_err = ERR_IO;
-		goto exit;
+		next = strchr(item, ',');
+		if(next != NULL)
+			*next++ = 0;
+		char *eq = strchr(item, '=');
+		if(eq != NULL)
+			*eq++ = 0;
+		int size = 0;
+		if(eq != NULL && run_value(b, eq, &expected))
+		{
+			if(strcmp(item, "CYCLES") == 0)
+			{
+				if(c.cycles > expected)
+				{
+					fprintf(b->msg, "%s: Took 0x%lX cycles, expected at most 0x%X!\n", 
+							part[0], c.cycles, expected);
+					ok = 0;
+				}
+				continue;
+			}
+			size = run_access(b, &c, item, &value, 0);
+		}
+		if(size == 0)
+		{
+			fprintf(b->msg, "%s: Invalid expectation \'%s\'!\n", part[0], item);
+			ok = 0;
+		}
+		else if(value != (expected & (size == 1 ? 0xFF : 0xFFFF)))
+		{
+			fprintf(b->msg, "%s: %s is 0x%X, expected 0x%X!\n", part[0], item, value, expected);
+			ok = 0;
+		}
 	}
-	printf("Assembling completed. Header checksum: 0x%X\n", calc_checksum(input));
-	
-exit:
-	if(labels != NULL)	free(labels);
-	if(input != NULL)	fclose(input);
-	if(output != NULL)	fclose(output);
-	return _err;
+	free(c.mem);
+	return ok;
 }
 
-void assemble(char *filename, FILE *input, FILE *output, label_t labels[], 
-			  size_t *label_no, unsigned int *out_no)
+/**
+ * Hashes len bytes of data onto h (64 bit FNV-1a), start off with HASH_INIT.
+ */
+unsigned long long hash_bytes(unsigned long long h, const void *data, size_t len)
 {
-	// First pass, leaves in labels
-	parse_file_pass1(filename, input, output, labels, label_no, out_no);
-	if(_err != ERR_NO)
-		return;
-	
-	rewind(output);
-	
-	// Second pass, fixes labels
-	parse_file_pass2(output, labels, label_no);
+	const unsigned char *p = (const unsigned char*)data;
+	while(len-- > 0)
+	{
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
 }
 
 /**
- * Converts a C-string to full upper case.
+ * Key of the build cache for the input file and the defines of a build. Under
+ * this key the cache keeps the list of files the last such build read.
  */
-void strtoupper(char *str)
+unsigned long long cache_options_key(build_t *b, source_t *src, options_t *opt)
 {
+	unsigned long long h = hash_bytes(HASH_INIT, CACHE_VERSION, sizeof(CACHE_VERSION));
+	h = hash_bytes(h, &opt->fix_header, sizeof(opt->fix_header));
+	h = hash_bytes(h, &opt->strip, sizeof(opt->strip));
+	h = hash_bytes(h, &opt->dedup, sizeof(opt->dedup));
+	h = hash_bytes(h, &opt->hram_size, sizeof(opt->hram_size));
+	h = hash_bytes(h, &opt->probe, sizeof(opt->probe));
+	h = hash_bytes(h, &opt->probe_port, sizeof(opt->probe_port));
+	if(opt->probe_labels != NULL)
+		h = hash_bytes(h, opt->probe_labels, strlen(opt->probe_labels) + 1);
 	size_t i;
-	for(i = 0; i < strlen(str); ++i)
-		str[i] = toupper(str[i]);
+	for(i = 0; i < opt->include_dir_no; ++i)
+		h = hash_bytes(h, opt->include_dirs[i], strlen(opt->include_dirs[i]) + 1);
+	h = hash_bytes(h, src->name, strlen(src->name) + 1);
+	h = hash_bytes(h, &src->hash, sizeof(src->hash));
+	for(i = 0; i < b->define_no; ++i)
+	{
+		h = hash_bytes(h, b->defines[i].string, strlen(b->defines[i].string) + 1);
+		h = hash_bytes(h, &b->defines[i].value, sizeof(long));
+	}
+	return h;
 }
 
 /**
- * Find a certain label in a range of a list. If not found, adds element after
- * list and returns that element.
+ * Key of the build cache for the ROM: the options key and the names and 
+ * contents of all files read by the build.
  */
-label_t *find_label(label_t *begin, size_t *elements, char *string)
+unsigned long long cache_rom_key(build_t *b, unsigned long long h)
 {
-	label_t *end = begin + *elements;
-	while(*(begin->string) != 0 
-		  && strcmp(begin->string, string) != 0 
-		  && begin++ != end);
-	if(*(begin->string) == 0)
+	unsigned int i;
+	for(i = 0; i < b->dep_no; ++i)
 	{
-		strcpy(begin->string, string);
-		*elements += 1;
+		h = hash_bytes(h, b->deps[i]->name, strlen(b->deps[i]->name) + 1);
+		h = hash_bytes(h, &b->deps[i]->hash, sizeof(b->deps[i]->hash));
 	}
-	return begin;
+	return h;
 }
 
+#ifdef __linux__
 /**
- * Parses a file for the first pass. The first pass assembles instructions
- * to bytecode, ignores comments, imports binary data, and stores label source
- * bytepositions. Leaves labels in instructions intact (parsed in second pass).
- * Generates a .o file.
+ * Looks up the ROM of a build in the cache. The files the last build with the
+ * same input and defines read are loaded, and if the ROM for their current 
+ * contents is in the cache it becomes the output of the build. Returns 0 if 
+ * it is not, the build then has to be assembled.
  */
-void parse_file_pass1(char *filename, FILE *input, FILE *output, 
-					  label_t labels[], size_t *label_no,
-					  unsigned int *out_no)
+int cache_lookup(build_t *b, unsigned long long key, options_t *opt)
 {
-	char in_buf[IN_BUFLEN];
-	unsigned int line_no = 0;
-	size_t str_pos;
+	char name[INCL_FLEN * 2];
+	char dep[INCL_FLEN + 2];
 	
-	while(fgets(in_buf, IN_BUFLEN, input) != NULL)
+	snprintf(name, sizeof(name), "%s/%016llx.m", opt->cache, key);
+	FILE *f = fopen(name, "r");
+	if(f == NULL)
+		return 0;
+	while(fgets(dep, sizeof(dep), f) != NULL)
 	{
-		if(_err != 0)
-			break;
-		
-		line_no++;
-		str_pos = 0;
-		while(in_buf[str_pos] == ' ' || in_buf[str_pos] == '\t')
-			++str_pos;
-		
-		size_t str_len = strlen(in_buf+str_pos);
-		
-		// Comment, ignore rest of string
-		if(in_buf[str_pos] == '#')
-			continue;
-		// Empty line
-		if(in_buf[str_pos] == '\n')
-			continue;
-		// .include file
-		if(strstr(in_buf+str_pos, ".include") == in_buf+str_pos)
-		{
-			str_pos += 5;
-			char inc_filename[INCL_FLEN];
-			char *p1 = strchr(in_buf+str_pos, '\"');
-			char *p2 = strrchr(in_buf+str_pos, '\"');
-			if(p1 == NULL || p2 == NULL)
-			{
-				printf("%s:%u: Syntax error: \" expected near %s!\n", filename, line_no, in_buf + str_pos);
-				_err = ERR_SYNT;
-				return;
-			}
-			*p2 = 0;
-			strncpy(inc_filename, p1+1, INCL_FLEN-1);
-			FILE *inc_input = fopen(inc_filename, "r");
-			if(inc_input == NULL)
-			{
-				printf("%s:%u: Unable to open included file \'%s\'!\n", filename, line_no, inc_filename);
-				_err = ERR_SYNT;
-				return;
-			}
-			parse_file_pass1(inc_filename, inc_input, output, labels, label_no, out_no);
-			
-			fclose(inc_input);
-			continue;
-		}
-		
-		// .data segment, parse rest as block of data seperated by ','
-		if(strstr(in_buf+str_pos, ".data") == in_buf+str_pos)
-		{
-			str_pos += 5;
-			while(in_buf[str_pos] == ' ' || in_buf[str_pos] == '\t')
-				++str_pos;
-			
-			if(in_buf[str_pos] == '#')	// ignore comments
-				continue;
-			
-			if(in_buf[str_pos] == '\"')	// string
-			{
-				++str_pos;
-				while(in_buf[str_pos] != '\"' && in_buf[str_pos])
-				{
-					fputc(in_buf[str_pos], output);
-					++str_pos;
-					*out_no += 1;
-				}
-				continue;
-			}
-			else if(isdigit(in_buf[str_pos]))	// constant block
-			{			
-				char *pch = strtok(in_buf+str_pos, ", \n\t");
-				while(pch != NULL)
-				{
-					if(*pch == '#')	// ignore comments
-						break;
-					
-					long i = strtol(pch, NULL, 16);
-					fputc((int)i, output);
-					*out_no += 1;
-					pch = strtok(NULL, ", \n\t");
-				}
-				continue;
-			}
-		}
-		// .align n: fill with n zeros.
-		if(strstr(in_buf+str_pos, ".align") == in_buf+str_pos)
-		{
-			str_pos += 6;
-			while(in_buf[str_pos] == ' ' || in_buf[str_pos] == '\t')
-				++str_pos;
-			if(isdigit(in_buf[str_pos]))
-			{
-				long i = strtol(in_buf + str_pos, NULL, 16);
-				*out_no += i;
-				while(i-- > 0)
-					fputc(0x00, output);
-				continue;
-			}
-			else
-			{
-				printf("%s:%u: Syntax error, number constant expected near %s", filename, line_no, in_buf + str_pos);
-				return;
-			}
-		}
-		// Labels
-		size_t llen = strcspn(in_buf+str_pos, ":");
-		if(llen != str_len)
+		dep[strcspn(dep, "\n")] = 0;
+		lock_encoding(1);
+		source_t *s = dep[0] == '@' ? load_file(dep + 1, 1) : load_source(dep);
+		lock_encoding(0);
+		if(s == NULL)
 		{
-			// label that starts with a digit must be a forced byte alignment.
-			if(isdigit(in_buf[str_pos]))
-			{
-				unsigned int bytepos = strtol(in_buf+str_pos, NULL, 16);
-				if(bytepos < *out_no)
-				{
-					printf("%s:%u: Cannot align to byte adress 0x%X, assembled binary size is already 0x%X!\n", filename, line_no, bytepos, *out_no);
-					_err = ERR_SYNT;
-					return;
-				}
-				while(*out_no != bytepos)
-				{
-					fputc(0x00, output);
-					*out_no += 1;
-				}
-				continue;
-			}
-			
-			// otherwise treat as normal label.
-			char buf[LABEL_LEN];
-			strncpy(buf, in_buf+str_pos, llen);
-			buf[llen] = 0;
-			strtoupper(buf);
-			
-			label_t *l = find_label(labels, label_no, buf);
-			l->pointsto = *out_no;
-			continue;
+			fclose(f);
+			b->dep_no = 0;
+			return 0;
 		}
-		
-		parse_instr(in_buf+str_pos, output, out_no, &line_no, filename,
-					labels, label_no);
+		add_dep(b, s);
+	}
+	fclose(f);
+	
+	key = cache_rom_key(b, key);
+	snprintf(name, sizeof(name), "%s/%016llx.gb", opt->cache, key);
+	f = fopen(name, "rb");
+	if(f == NULL)
+	{
+		b->dep_no = 0;
+		return 0;
 	}
+	size_t n;
+	do
+	{
+		out_reserve(b, IN_BUFLEN);
+		n = fread(b->out + b->out_no, 1, IN_BUFLEN, f);
+		b->out_no += n;
+	} while(n > 0);
+	
+	// Entries that were not used for the longest time are evicted first
+	futimens(fileno(f), NULL);
+	fclose(f);
+	return 1;
 }
 
 /**
- * Parse file for a second pass. Changes all labels in their labelpositions.
+ * Writes a file of the cache under a temporary name first, so that other
+ * builds never see a partly written file.
  */
-void parse_file_pass2(FILE *output, label_t labels[], size_t *label_no)
+int cache_write(char *name, void *data, size_t len)
 {
-	size_t i;
-	for(i = 0; i < *label_no; ++i)
+	static unsigned int tmp_no = 0;
+	char tmp_name[INCL_FLEN * 2 + 32];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.%d.%u.tmp", name, (int)getpid(), 
+			 __atomic_fetch_add(&tmp_no, 1, __ATOMIC_RELAXED));
+	FILE *f = fopen(tmp_name, "wb");
+	if(f == NULL)
+		return 0;
+	size_t written = fwrite(data, 1, len, f);
+	if(fclose(f) != 0 || written != len || rename(tmp_name, name) != 0)
 	{
-		if(labels[i].pointsto == (unsigned int)-1)
-		{
-			printf("%s:%d: Undefined label \'%s\' referenced!\n", labels[i].reffile, labels[i].refline, labels[i].string);
-			_err = ERR_SYNT;
-			return;
-		}
-		size_t j;
-		for(j = 0; j < labels[i].points_no; ++j)
-		{
-			fsetpos(output, &labels[i].pointsfrom[j]);
-			if(labels[i].relative[j])
-			{
-				char rel = labels[i].pointsto - ftell(output) - 1;
-				fputc(rel, output);
-			}
-			else
-			{
-				fputc(labels[i].pointsto & 0xFF, output);
-				fputc((labels[i].pointsto >> 8) & 0xFF, output);
-			}
-		}
+		remove(tmp_name);
+		return 0;
 	}
+	return 1;
+}
+
+typedef struct
+{
+	char *name;
+	time_t mtime;
+	off_t size;
+} cache_entry_t;
+
+int cmp_cache_entry(const void *a, const void *b)
+{
+	time_t ta = ((const cache_entry_t*)a)->mtime, tb = ((const cache_entry_t*)b)->mtime;
+	return (ta > tb) - (ta < tb);
 }
 
 /**
- * Calculate checksum of a binary.
+ * Removes the least recently used files of the cache once it is larger than
+ * its maximum size, down to three quarters of it.
  */
-unsigned char calc_checksum(FILE *input)
+void cache_evict(options_t *opt)
 {
-	char c;
-	unsigned char checksum = 0;
-	unsigned int i = 0;
-	while(i < 0x0134)
+	DIR *dir = opendir(opt->cache);
+	if(dir == NULL)
+		return;
+	
+	cache_entry_t *entries = NULL;
+	size_t entry_no = 0, i;
+	unsigned long long total = 0;
+	struct dirent *ent;
+	struct stat st;
+	char name[INCL_FLEN * 2 + 256];
+	while((ent = readdir(dir)) != NULL)
 	{
-		c = fgetc(input);
-		++i;
+		// Files being written by other builds are left alone
+		if(ent->d_name[0] == '.' || strstr(ent->d_name, ".tmp") != NULL)
+			continue;
+		snprintf(name, sizeof(name), "%s/%s", opt->cache, ent->d_name);
+		if(stat(name, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		if(entry_no % 64 == 0)
+			entries = (cache_entry_t*)realloc(entries, 
+								sizeof(cache_entry_t) * (entry_no + 64));
+		entries[entry_no].name = strdup(name);
+		entries[entry_no].mtime = st.st_mtime;
+		entries[entry_no++].size = st.st_size;
+		total += st.st_size;
 	}
-	while(i < 0x014D)
+	closedir(dir);
+	
+	if(total > opt->cache_size)
 	{
-		c = fgetc(input);
-		checksum = checksum - c - 1;
-		++i;
+		qsort(entries, entry_no, sizeof(cache_entry_t), cmp_cache_entry);
+		// Another build may remove the same file, that is fine
+		for(i = 0; i < entry_no && total > opt->cache_size / 4 * 3; ++i)
+		{
+			unlink(entries[i].name);
+			total -= entries[i].size;
+		}
 	}
+	for(i = 0; i < entry_no; ++i)
+		free(entries[i].name);
+	free(entries);
+}
+
+/**
+ * Puts the ROM of a successful build in the cache, together with the list of
+ * files it read. Failing to do so is not an error, the cache is only skipped.
+ */
+void cache_store(build_t *b, unsigned long long key, options_t *opt)
+{
+	char name[INCL_FLEN * 2];
+	unsigned int i;
+	
+	if(mkdir(opt->cache, 0777) != 0 && errno != EEXIST)
+		return;
+	
+	char *list = NULL;
+	size_t list_len = 0;
+	FILE *f = open_memstream(&list, &list_len);
+	// Binary files are marked with a @
+	for(i = 0; i < b->dep_no; ++i)
+		fprintf(f, "%s%s\n", b->deps[i]->binary ? "@" : "", b->deps[i]->name);
+	fclose(f);
+	
+	snprintf(name, sizeof(name), "%s/%016llx.gb", opt->cache, cache_rom_key(b, key));
+	int stored = cache_write(name, b->out, b->out_no);
+	snprintf(name, sizeof(name), "%s/%016llx.m", opt->cache, key);
+	stored = stored && cache_write(name, list, list_len);
+	free(list);
+	
+	if(stored)
+		cache_evict(opt);
+}
+#else
+int cache_lookup(build_t *b, unsigned long long key, options_t *opt)
+{
+	return 0;
+}
+
+void cache_store(build_t *b, unsigned long long key, options_t *opt)
+{
+}
+#endif
+
+/**
+ * Fills in the header checksum at 0x14D and the global checksum (big endian) 
+ * at 0x14E of the assembled binary. Returns 0 if the binary is too small to 
+ * hold a header.
+ */
+int fix_header(build_t *b)
+{
+	unsigned char checksum = 0;
+	unsigned int i;
 	
-	return checksum;
+	if(b->out_no < 0x150)
+		return 0;
+	for(i = 0x134; i < 0x14D; ++i)
+		checksum = checksum - b->out[i] - 1;
+	b->out[0x14D] = checksum;
+	
+	// Sum of all other bytes. Separate sums per lane so that the compiler can
+	// vectorize the loop, ROMs can be several megabytes.
+	unsigned int lanes[16] = {0};
+	unsigned int end = 0x14E & ~15u, sum = 0;
+	for(i = 0; i < end; ++i)
+		lanes[i & 15] += b->out[i];
+	for(i = end; i < 0x14E; ++i)
+		sum += b->out[i];
+	end = 0x150 + ((b->out_no - 0x150) & ~15u);
+	for(i = 0x150; i < end; i += 16)
+	{
+		unsigned int j;
+		for(j = 0; j < 16; ++j)
+			lanes[j] += b->out[i + j];
+	}
+	for(i = end; i < b->out_no; ++i)
+		sum += b->out[i];
+	for(i = 0; i < 16; ++i)
+		sum += lanes[i];
+	b->out[0x14E] = sum >> 8;
+	b->out[0x14F] = sum;
+	return 1;
 }
 
 // terrible macro's incoming, read at own risk :)
@@ -405,13 +6201,15 @@ unsigned char calc_checksum(FILE *input)
 #define match4(x)	(strcmp(instr[4],x) == 0)
 #define matchd1		(isdigit(*instr[1]))
 #define matchd2		(isdigit(*instr[2]))
-#define matchdx(x)	(isdigit(*x))
+#define matchdx(x)	(isdigit(*(x)))
+// hex number without a leading digit, like C000
+#define matchhx(x)	(strspn((x), "0123456789ABCDEF") == strlen(x))
 // pointers have () brackets
 #define matchp1		((instr[1][0] == '(') \
 					&& (instr[1][strlen(instr[1])-1] == ')'))
 #define matchp2		((instr[2][0] == '(') \
 					&& (instr[2][strlen(instr[2])-1] == ')'))
-#define write(x)	{fputc(x, output); (*out_no)++;}
+#define write(x)	{line_put(src, line, x);}
 // decimal short
 #define writeds1	{write((int)strtol(instr[1], NULL, 16));}
 #define writeds2	{write((int)strtol(instr[2], NULL, 16));}
@@ -426,38 +6224,18 @@ unsigned char calc_checksum(FILE *input)
 					write((int)(i & 0xFF));}
 // label
 
-#define writellx(x)	\
-{	label_t *l = find_label(labels, label_no, x);	\
-	fgetpos(output, &l->pointsfrom[l->points_no]);	\
-	l->relative[l->points_no++] = 0;				\
-	if(l->refline == (unsigned int)-1)				\
-	{												\
-		l->refline = *line_no;						\
-		strncpy(l->reffile, filename, INCL_FLEN-1);	\
-	}												\
-	write(0); write(0);	}
+#define writellx(x)	{line_fixup(src, line, x, 0); write(0); write(0);}
 #define writell1	{writellx(instr[1]);}
 #define writell2	{writellx(instr[2]);}
 
-#define writelsx(x)	\
-{	label_t *l = find_label(labels, label_no, x);	\
-	fgetpos(output, &l->pointsfrom[l->points_no]);	\
-	l->relative[l->points_no++] = 1;				\
-	if(l->refline == (unsigned int)-1)				\
-	{												\
-		l->refline = *line_no;						\
-		strncpy(l->reffile, filename, INCL_FLEN-1);	\
-	}												\
-	write(0);}
+#define writelsx(x)	{line_fixup(src, line, x, 1); write(0);}
 #define writels1	{writelsx(instr[1]);}
 #define writels2	{writelsx(instr[2]);}
 
 /**
- * Parse an instruction line. Leaves labels in the code.
+ * Parse an instruction line to the bytes of a line. Leaves labels in the code.
  */
-void parse_instr(char *str, FILE *output, unsigned int *out_no, 
-				 unsigned int *line_no, char *filename,
-				 label_t labels[], size_t *label_no)
+void parse_instr(char *str, source_t *src, line_t *line)
 {
 	strtoupper(str);
 	
@@ -469,6 +6247,11 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 	{
 		if(*pch == '#')	// Ignore comments, yet again
 			break;
+		if(instr_n == MAX_INSTR)
+		{
+			line_error(src, line, "Too many operands near \'%s\'", pch);
+			return;
+		}
 		instr[instr_n++] = pch;
 		pch = strtok(NULL, ", \n\t");
 	}
@@ -490,9 +6273,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 			if(match0("RRCA")){	write(0x0F);				break;}
 			if(match0("SCF")){	write(0x37);				break;}
 			if(match0("STOP")){	write(0x10); write(0x00);	break;}
-			printf("%s:%u: error: syntax error near \'%s\'\n", 
-				   filename, *line_no, instr[0]);
-			_err = ERR_SYNT;
+			line_error(src, line, "Syntax error near \'%s\'", instr[0]);
 			break;
 		case 2:
 			if(match0("ADD"))// ADD n
@@ -506,8 +6287,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("L")){	write(0x85);				break;}
 				if(match1("(HL)")){	write(0x86);				break;}
 				if(matchd1){		write(0xC6);	writeds1;	break;}	// Digit
-				printf("%s:%u: error: register, (HL) or constant byte expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register, (HL) or constant byte expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("ADC"))// ADC n
@@ -521,8 +6301,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("L")){	write(0x8D);				break;}
 				if(match1("(HL)")){	write(0x8E);				break;}
 				if(matchd1){		write(0xCE);	writeds1;	break;}	// Digit
-				printf("%s:%u: error: register, (HL) or constant byte expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register, (HL) or constant byte expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("AND"))// AND n
@@ -536,8 +6315,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("L")){	write(0xA5);				break;}
 				if(match1("(HL)")){	write(0xA6);				break;}
 				if(matchd1){		write(0xE6);	writeds1;	break;}	// Digit
-				printf("%s:%u: error: register, (HL) or constant byte expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register, (HL) or constant byte expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("CALL"))// CALL nn
@@ -557,8 +6335,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("L")){	write(0xBD);				break;}
 				if(match1("(HL)")){	write(0xBE);				break;}
 				if(matchd1){		write(0xFE);	writeds1;	break;}	// Digit
-				printf("%s:%u: error: register, (HL) or constant byte expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register, (HL) or constant byte expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("DEC"))// DEC n, DEC nn
@@ -575,8 +6352,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("DE")){	write(0x1B);				break;}
 				if(match1("HL")){	write(0x2B);				break;}
 				if(match1("SP")){	write(0x3B);				break;}
-				printf("%s:%u: error: register, register-pair or (HL) expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register, register-pair or (HL) expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("INC"))// INC n, INC nn
@@ -593,8 +6369,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("DE")){	write(0x13);				break;}
 				if(match1("HL")){	write(0x23);				break;}
 				if(match1("SP")){	write(0x33);				break;}
-				printf("%s:%u: error: register, register-pair or (HL) expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register, register-pair or (HL) expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("JP"))// JP (HL), JP nn
@@ -620,8 +6395,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("L")){	write(0xB5);				break;}
 				if(match1("(HL)")){	write(0xB6);				break;}
 				if(matchd1){		write(0xF6);	writeds1;	break;}	// Digit
-				printf("%s:%u: error: register, (HL) or constant byte expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register, (HL) or constant byte expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("POP"))// POP nn
@@ -630,8 +6404,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("BC")){	write(0xC1);				break;}
 				if(match1("DE")){	write(0xD1);				break;}
 				if(match1("HL")){	write(0xE1);				break;}
-				printf("%s:%u: error: register-pair expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register-pair expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("PUSH"))// PUSH nn
@@ -640,8 +6413,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("BC")){	write(0xC5);				break;}
 				if(match1("DE")){	write(0xD5);				break;}
 				if(match1("HL")){	write(0xE5);				break;}
-				printf("%s:%u: error: register-pair expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register-pair expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("RET"))// RET cc
@@ -650,8 +6422,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("Z")){	write(0xC8);				break;}
 				if(match1("NC")){	write(0xD0);				break;}
 				if(match1("C")){	write(0xD8);				break;}
-				printf("%s:%u: error: condition expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Condition expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("RLC"))// RLC n
@@ -664,8 +6435,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("H")){	write(0xCB); write(0x04);	break;}
 				if(match1("L")){	write(0xCB); write(0x05);	break;}
 				if(match1("(HL)")){	write(0xCB); write(0x06);	break;}
-				printf("%s:%u: error: register or (HL) expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register or (HL) expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("RL"))// RL n
@@ -678,8 +6448,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("H")){	write(0xCB); write(0x14);	break;}
 				if(match1("L")){	write(0xCB); write(0x15);	break;}
 				if(match1("(HL)")){	write(0xCB); write(0x16);	break;}
-				printf("%s:%u: error: register or (HL) expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register or (HL) expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("RRC"))// RRC n
@@ -692,8 +6461,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("H")){	write(0xCB); write(0x0C);	break;}
 				if(match1("L")){	write(0xCB); write(0x0D);	break;}
 				if(match1("(HL)")){	write(0xCB); write(0x0E);	break;}
-				printf("%s:%u: error: register or (HL) expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register or (HL) expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("RR"))// RR n
@@ -706,8 +6474,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("H")){	write(0xCB); write(0x1C);	break;}
 				if(match1("L")){	write(0xCB); write(0x1D);	break;}
 				if(match1("(HL)")){	write(0xCB); write(0x1E);	break;}
-				printf("%s:%u: error: register or (HL) expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register or (HL) expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("RST"))// RST n
@@ -725,14 +6492,12 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 						case 0x28:	write(0xEF);	break;
 						case 0x30:	write(0xF7);	break;
 						case 0x38:	write(0xFF);	break;
-						default:	printf("%s:%u: error: valid restart address expected near \'%s\'\n", filename, *line_no, instr[1]);
-									_err = ERR_SYNT;
+						default:	line_error(src, line, "Valid restart address expected near \'%s\'", instr[1]);
 									break;
 					}
 					break;
 				}
-				printf("%s:%u: error: valid restart address expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Valid restart address expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("SBC"))// SBC n
@@ -746,8 +6511,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("L")){	write(0x9D);				break;}
 				if(match1("(HL)")){	write(0x9E);				break;}
 				if(matchd1){		write(0xDE);	writeds1;	break;}	// Digit
-				printf("%s:%u: error: register, (HL) or constant byte expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register, (HL) or constant byte expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("SLA"))// SLA n
@@ -760,8 +6524,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("H")){	write(0xCB); write(0x24);	break;}
 				if(match1("L")){	write(0xCB); write(0x25);	break;}
 				if(match1("(HL)")){	write(0xCB); write(0x26);	break;}
-				printf("%s:%u: error: register or (HL) expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register or (HL) expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("SRA"))// SRA n
@@ -774,8 +6537,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("H")){	write(0xCB); write(0x2C);	break;}
 				if(match1("L")){	write(0xCB); write(0x2D);	break;}
 				if(match1("(HL)")){	write(0xCB); write(0x2E);	break;}
-				printf("%s:%u: error: register or (HL) expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register or (HL) expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("SRL"))// SRL n
@@ -788,8 +6550,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("H")){	write(0xCB); write(0x3C);	break;}
 				if(match1("L")){	write(0xCB); write(0x3D);	break;}
 				if(match1("(HL)")){	write(0xCB); write(0x3E);	break;}
-				printf("%s:%u: error: register or (HL) expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register or (HL) expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("SUB"))// SUB n
@@ -803,8 +6564,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("L")){	write(0x95);				break;}
 				if(match1("(HL)")){	write(0x96);				break;}
 				if(matchd1){		write(0xD6);	writeds1;	break;}	// Digit
-				printf("%s:%u: error: register, (HL) or constant byte expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register, (HL) or constant byte expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("SWAP"))// SWAP n
@@ -817,8 +6577,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("H")){	write(0xCB); write(0x34);	break;}
 				if(match1("L")){	write(0xCB); write(0x35);	break;}
 				if(match1("(HL)")){	write(0xCB); write(0x36);	break;}
-				printf("%s:%u: error: register or (HL) expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register or (HL) expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("XOR"))// XOR n
@@ -832,21 +6591,17 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match1("L")){	write(0xAD);				break;}
 				if(match1("(HL)")){	write(0xAE);				break;}
 				if(matchd1){		write(0xEE); writeds1;		break;}	// Digit
-				printf("%s:%u: error: register, (HL) or constant byte expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register, (HL) or constant byte expected near \'%s\'", instr[1]);
 				break;
 			}
-			printf("%s:%u: error: syntax error near \'%s\'\n", 
-				   filename, *line_no, instr[0]);
-			_err = ERR_SYNT;
+			line_error(src, line, "Syntax error near \'%s\'", instr[0]);
 			break;
 		case 3:
 			if(match0("ADC"))// ADC A,n
 			{
 				if(!match1("A"))
 				{
-					printf("%s:%u: error: A expected near \'%s\'\n", filename, *line_no, instr[1]);
-					_err = ERR_SYNT;
+					line_error(src, line, "A expected near \'%s\'", instr[1]);
 					break;
 				}
 				if(match2("A")){	write(0x8F);				break;}
@@ -858,8 +6613,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match2("L")){	write(0x8D);				break;}
 				if(match2("(HL)")){	write(0x8E);				break;}
 				if(matchd2){		write(0xCE); writeds2;		break;}	// Digit
-				printf("%s:%u: error: register, (HL) or constant byte expected near \'%s\'\n", filename, *line_no, instr[2]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register, (HL) or constant byte expected near \'%s\'", instr[2]);
 				break;
 			}
 			if(match0("ADD"))// ADD A,n; ADD HL,n; ADD SP,n
@@ -875,8 +6629,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 					if(match2("L")){	write(0x85);				break;}
 					if(match2("(HL)")){	write(0x86);				break;}
 					if(matchd2){		write(0xC6); writeds2;		break;}	// Digit
-					printf("%s:%u: error: register, (HL) or constant byte expected near \'%s\'\n", filename, *line_no, instr[2]);
-					_err = ERR_SYNT;
+					line_error(src, line, "Register, (HL) or constant byte expected near \'%s\'", instr[2]);
 					break;
 				}
 				if(match1("HL"))
@@ -885,19 +6638,16 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 					if(match2("DE")){	write(0x19);				break;}
 					if(match2("HL")){	write(0x29);				break;}
 					if(match2("SP")){	write(0x39);				break;}
-					printf("%s:%u: error: register-pair expected near \'%s\'\n", filename, *line_no, instr[2]);
-					_err = ERR_SYNT;
+					line_error(src, line, "Register-pair expected near \'%s\'", instr[2]);
 					break;
 				}
 				if(match1("SP"))
 				{
 					if(matchd2){		write(0xE8); writeds2;	break;}
-					printf("%s:%u: error: byte constant expected near \'%s\'\n", filename, *line_no, instr[2]);
-					_err = ERR_SYNT;
+					line_error(src, line, "Byte constant expected near \'%s\'", instr[2]);
 					break;
 				}
-				printf("%s:%u: error: A, HL or SP expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "A, HL or SP expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("BIT"))// BIT b,r
@@ -907,8 +6657,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 					unsigned int i = strtol(instr[1], NULL, 16);
 					if(i > 7)
 					{
-						printf("%s:%u: error: value between 0 and 7 expected near \'%s\'\n", filename, *line_no, instr[1]);
-						_err = ERR_SYNT;
+						line_error(src, line, "Value between 0 and 7 expected near \'%s\'", instr[1]);
 						break;
 					}
 					if(match2("A")){	write(0xCB); write(0x47);	break;}
@@ -919,12 +6668,10 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 					if(match2("H")){	write(0xCB); write(0x44);	break;}
 					if(match2("L")){	write(0xCB); write(0x45);	break;}
 					if(match2("(HL)")){	write(0xCB); write(0x46);	break;}
-					printf("%s:%u: error: register or (HL) expected near \'%s\'\n", filename, *line_no, instr[2]);
-					_err = ERR_SYNT;
+					line_error(src, line, "Register or (HL) expected near \'%s\'", instr[2]);
 					break;
 				}
-				printf("%s:%u: error: byte constant expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Byte constant expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("CALL"))// CALL cc,nn
@@ -935,8 +6682,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				else if(match1("C")){	write(0xDC);}
 				else
 				{
-					printf("%s:%u: error: condition expected near \'%s\'\n", filename, *line_no, instr[1]);
-					_err = ERR_SYNT;
+					line_error(src, line, "Condition expected near \'%s\'", instr[1]);
 					break;
 				}
 				
@@ -951,8 +6697,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				else if(match1("C")){	write(0xDA);}
 				else
 				{
-					printf("%s:%u: error: condition expected near \'%s\'\n", filename, *line_no, instr[1]);
-					_err = ERR_SYNT;
+					line_error(src, line, "Condition expected near \'%s\'", instr[1]);
 					break;
 				}
 				
@@ -968,8 +6713,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 					else if(match1("C")){	write(0x38);}
 					else
 					{
-						printf("%s:%u: error: condition expected near \'%s\'\n", filename, *line_no, instr[1]);
-						_err = ERR_SYNT;
+						line_error(src, line, "Condition expected near \'%s\'", instr[1]);
 						break;
 					}
 					
@@ -1018,10 +6762,9 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 			if(match0("LD") && matchp1 && match2("SP"))// LD (nn),SP
 			{
 				write(0x08);
-				if(matchdx(instr[1]+1)){writedlx(instr[1]+1);}
+				if(matchdx(instr[1]+1)){writedlx(instr[1]+1);	break;}
 				//else{					writellx(instr[1]+1);}
-				printf("%s:%u: error: constant pointer expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Constant pointer expected near \'%s\'", instr[1]);
 				break;
 				
 			}
@@ -1053,7 +6796,15 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 						else			// LD A,(nn)
 						{
 							write(0xFA);
-							writedlx(instr[2] + 1);
+							if(matchdx(instr[2] + 1)){	writedlx(instr[2] + 1);}
+							else
+							{
+								instr[2][strlen(instr[2])-1] = 0;	// cut off )
+								writellx(instr[2] + 1);
+								// A label, or else a hex number like C000
+								if(matchhx(instr[2] + 1))
+									line->fixups[line->fixup_no-1].number = 1;
+							}
 							break;
 						}
 					}
@@ -1188,8 +6939,14 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 					{
 						write(0xEA);
 						if(matchdx(instr[1] + 1)){	writedlx(instr[1] + 1);}
-					//	else{						writelx(instr[1] + 1);}
-						
+						else
+						{
+							instr[1][strlen(instr[1])-1] = 0;	// cut off )
+							writellx(instr[1] + 1);
+							// A label, or else a hex number like C000
+							if(matchhx(instr[1] + 1))
+								line->fixups[line->fixup_no-1].number = 1;
+						}
 						break;
 					}
 				}
@@ -1203,8 +6960,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 								else{			write(0x21);writell2;	break;}}
 				if(match1("SP")){if(matchd2){	write(0x31);writedl2;	break;}
 								else{			write(0x31);writell2;	break;}}
-				printf("%s:%u: error: syntax error near \'%s\'\n", filename, *line_no, instr[0]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Syntax error near \'%s\'", instr[0]);
 				break;
 			}
 			if(match0("LDH"))// LDH (n),A; LDH A,(n)
@@ -1221,8 +6977,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 					writedsx(instr[2]+1);
 					break;
 				}
-				printf("%s:%u: error: A or constant pointer expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "A or constant pointer expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("LD") && match1("SP") && match2("HL"))// LD SP,HL
@@ -1237,8 +6992,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 					unsigned int i = strtol(instr[1], NULL, 16);
 					if(i > 7)
 					{
-						printf("%s:%u: error: value between 0 and 7 expected near \'%s\'\n", filename, *line_no, instr[1]);
-						_err = ERR_SYNT;
+						line_error(src, line, "Value between 0 and 7 expected near \'%s\'", instr[1]);
 						break;
 					}
 					if(match2("A")){	write(0xCB); write(0x87);	break;}
@@ -1249,12 +7003,10 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 					if(match2("H")){	write(0xCB); write(0x84);	break;}
 					if(match2("L")){	write(0xCB); write(0x85);	break;}
 					if(match2("(HL)")){	write(0xCB); write(0x86);	break;}
-					printf("%s:%u: error: register or (HL) expected near \'%s\'\n", filename, *line_no, instr[2]);
-					_err = ERR_SYNT;
+					line_error(src, line, "Register or (HL) expected near \'%s\'", instr[2]);
 					break;
 				}
-				printf("%s:%u: error: byte constant expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Byte constant expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("SBC") && match1("A"))// SBC A,n
@@ -1268,8 +7020,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				if(match2("L")){	write(0x9D);				break;}
 				if(match2("(HL)")){	write(0x9E);				break;}
 				if(matchd2){		write(0xDE);	writeds2;	break;}	// Digit
-				printf("%s:%u: error: register, (HL) or constant byte expected near \'%s\'\n", filename, *line_no, instr[2]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Register, (HL) or constant byte expected near \'%s\'", instr[2]);
 				break;
 			}
 			if(match0("SET"))// SET b,r
@@ -1279,8 +7030,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 					unsigned int i = strtol(instr[1], NULL, 16);
 					if(i > 7)
 					{
-						printf("%s:%u: error: value between 0 and 7 expected near \'%s\'\n", filename, *line_no, instr[1]);
-						_err = ERR_SYNT;
+						line_error(src, line, "Value between 0 and 7 expected near \'%s\'", instr[1]);
 						break;
 					}
 					if(match2("A")){	write(0xCB); write(0xC7);	break;}
@@ -1291,12 +7041,10 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 					if(match2("H")){	write(0xCB); write(0xC4);	break;}
 					if(match2("L")){	write(0xCB); write(0xC5);	break;}
 					if(match2("(HL)")){	write(0xCB); write(0xC6);	break;}
-					printf("%s:%u: error: register or (HL) expected near \'%s\'\n", filename, *line_no, instr[2]);
-					_err = ERR_SYNT;
+					line_error(src, line, "Register or (HL) expected near \'%s\'", instr[2]);
 					break;
 				}
-				printf("%s:%u: error: byte constant expected near \'%s\'\n", filename, *line_no, instr[1]);
-				_err = ERR_SYNT;
+				line_error(src, line, "Byte constant expected near \'%s\'", instr[1]);
 				break;
 			}
 			if(match0("LD") && match1("HL") 
@@ -1314,9 +7062,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				writeds2;
 				break;
 			}
-			printf("%s:%u: error: syntax error near \'%s\'\n", 
-				   filename, *line_no, instr[0]);
-			_err = ERR_SYNT;
+			line_error(src, line, "Syntax error near \'%s\'", instr[0]);
 			break;
 		case 4:
 			if((match0("LD") && match1("HL") && match2("SP+"))// LD HL, SP+ n
@@ -1329,9 +7075,7 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				writedsx(foo);
 				break;	
 			}
-			printf("%s:%u: error: syntax error near \'%s\'\n", 
-				   filename, *line_no, instr[0]);
-			_err = ERR_SYNT;
+			line_error(src, line, "Syntax error near \'%s\'", instr[0]);
 			break;
 		case 5:
 			if((match0("LD") && match1("HL") && match2("SP")) && match3("+"))
@@ -1343,15 +7087,11 @@ void parse_instr(char *str, FILE *output, unsigned int *out_no,
 				writedsx(foo);
 				break;	
 			}
-			printf("%s:%u: error: syntax error near \'%s\'\n", 
-				   filename, *line_no, instr[0]);
-			_err = ERR_SYNT;
+			line_error(src, line, "Syntax error near \'%s\'", instr[0]);
 			break;
 			
 		default: 
-			printf("%s:%u: error: syntax error near \'%s\'\n", 
-				   filename, *line_no, instr[0]);
-			_err = ERR_SYNT;
+			line_error(src, line, "Syntax error near \'%s\'", instr[0]);
 			break;
 	}
 }
\ No newline at end of file
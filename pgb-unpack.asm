@@ -0,0 +1,79 @@
+# Decompression routines for .incbin_compressed data.
+# .include "pgb-unpack.asm" and call the routine that matches the data:
+#	LD HL,compressed
+#	LD DE,destination
+#	CALL unrle (or CALL unlz)
+# HL ends up after the compressed data, DE after the decompressed data.
+# A and C are changed. Both routines sit in a .library section, so --strip
+# leaves out the one that is not used.
+# Data is copied by the CPU, so writes to VRAM must happen while the LCD is
+# off or during VBlank.
+
+.library
+
+# Run lengths: a control byte of 01-7F is followed by that many bytes to
+# copy, one of 80-FF by a byte to repeat (control - 7E) times. 00 ends.
+unrle:
+	LD A,(HL+)
+	AND A
+	RET Z
+	CP 0x80
+	JR NC,.run
+	LD C,A
+.copy:
+	LD A,(HL+)
+	LD (DE),A
+	INC DE
+	DEC C
+	JR NZ,.copy
+	JR unrle
+.run:
+	AND 0x7F
+	ADD A,0x02
+	LD C,A
+	LD A,(HL+)
+.fill:
+	LD (DE),A
+	INC DE
+	DEC C
+	JR NZ,.fill
+	JR unrle
+
+# LZ77: a control byte of 01-7F is followed by that many bytes to copy, one
+# of 80-FF by the distance - 1 (00-FF) to bytes written before, of which
+# (control - 7D) are copied again. 00 ends.
+unlz:
+	LD A,(HL+)
+	AND A
+	RET Z
+	CP 0x80
+	JR NC,.match
+	LD C,A
+.copy:
+	LD A,(HL+)
+	LD (DE),A
+	INC DE
+	DEC C
+	JR NZ,.copy
+	JR unlz
+.match:
+	AND 0x7F
+	ADD A,0x03
+	LD C,A
+	LD A,(HL+)
+	PUSH HL
+	# HL = DE - distance = DE + FF00 + (FF - (distance - 1))
+	CPL
+	LD L,A
+	LD H,0xFF
+	ADD HL,DE
+.again:
+	LD A,(HL+)
+	LD (DE),A
+	INC DE
+	DEC C
+	JR NZ,.again
+	POP HL
+	JR unlz
+
+.endlibrary
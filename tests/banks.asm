@@ -0,0 +1,22 @@
+# Routines in bank 0, 1 and 2, for --profile and --callgraph
+main:
+	CALL a1
+	CALL b1
+	JP main
+0x4000:
+a1:
+	CALL a2
+	RET
+a2:
+	NOP
+	RET
+cold:
+	NOP
+	NOP
+	RET
+0x8000:
+b1:
+	CALL a2
+	RET
+0xBFFF:
+.data 0
@@ -0,0 +1,17 @@
+# tests/run.sh writes asset.bin, then runs rle and lz to unpack it to C000
+0x150:
+start:
+	JP start
+rle:
+	LD HL,packed_rle
+	LD DE,0C000
+	JP unrle
+lz:
+	LD HL,packed_lz
+	LD DE,0C000
+	JP unlz
+.include "pgb-unpack.asm"
+packed_rle:
+.incbin_compressed "asset.bin", rle
+packed_lz:
+.incbin_compressed "asset.bin", lz
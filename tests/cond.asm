@@ -0,0 +1,21 @@
+# Conditional assembly: nested blocks, -D and skipped lines that are not valid
+.define TWO 2
+0x150:
+start:
+.if TWO == 2
+	LD A,1
+.ifdef EXTRA
+	LD B,1
+.else
+	LD B,2
+.endif
+.else
+	this is not assembled
+.endif
+.ifndef TWO
+	LD C,3
+.endif
+.if TWO > 3
+	NOP
+.endif
+	RET
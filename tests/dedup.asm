@@ -0,0 +1,12 @@
+# Two data blocks with the same bytes and one that differs
+0x150:
+start:
+	LD HL,second
+	LD DE,third
+	RET
+first:
+.data 1,2,3,4
+second:
+.data 1,2,3,4
+third:
+.data 1,2,3,5
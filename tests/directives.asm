@@ -0,0 +1,14 @@
+# Local labels that start like directives, and .table next to .tablew
+0x150:
+start:
+	JR .iffy
+.iffy:
+.else_x:
+.data_end:
+.table_loop:
+.align_x:
+.define_x:
+.include_x:
+	JR .data_end
+.table 4, i*2
+.tablew 2, i*100
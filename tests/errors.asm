@@ -0,0 +1,5 @@
+# Errors of both passes, printed in the order of the lines
+0x150:
+start:
+	JP nowhere
+	FOO
@@ -0,0 +1,5 @@
+# A ROM with a valid header, the checksums are filled in
+.include "dummy_header.asm"
+0x150:
+main:
+	JP main
@@ -0,0 +1,5 @@
+# A file that includes tests/part.asm, found with -I tests
+0x150:
+start:
+.include "part.asm"
+	RET
@@ -0,0 +1,21 @@
+# A JR that reaches with 2 bytes to spare, until --probe puts an exit probe
+# before the RET in between. Assembling must then fail with an out of range
+# error instead of wrapping the offset.
+0x150:
+start:
+	CALL f
+	JP start
+f:
+	AND A
+	JR .end
+	RET
+.data 00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00
+.data 00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00
+.data 00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00
+.data 00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00
+.data 00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00
+.data 00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00
+.data 00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00
+.data 00,00,00,00,00,00,00,00,00,00
+.end:
+	RET
@@ -0,0 +1,18 @@
+# Dispatch on A, once with the table in one page and once across two
+0x150:
+start:
+	JP start
+zero:
+	LD B,0A
+	RET
+one:
+	LD B,0B
+	RET
+two:
+	LD B,0C
+	RET
+dispatch:
+.jumptable zero, one, two
+0x2F2:
+crossing:
+.jumptable zero, one, two
@@ -0,0 +1,15 @@
+# The same local label in two scopes, and anonymous labels
+0x150:
+first:
+.loop:
+	JR .loop
+second:
+	JR +
+.loop:
+	JR .loop
++:
+-:
+	JR -
+	JR ++
+++:
+	RET
@@ -0,0 +1,6 @@
+# Too many operands is an error of the line, and the lines after it are still
+# checked
+0x150:
+start:
+	LD A,1,2,3,4,5,6,7,8,9,0A,0B,0C,0D,0E,0F,10,11,12,13,14,15,16,17,18,19,20
+	FOO
@@ -0,0 +1,29 @@
+# Local variables: a and b are never active at the same time and share their
+# space, c is called by a and gets its own
+0x150:
+start:
+	CALL a
+	CALL b
+	JP start
+a:
+.ramsection local
+a_count:
+.ds 1
+.endramsection
+	LD (a_count),A
+	CALL c
+	RET
+b:
+.ramsection local
+b_count:
+.ds 1
+.endramsection
+	LD (b_count),A
+	RET
+c:
+.ramsection local
+c_count:
+.ds 1
+.endramsection
+	LD (c_count),A
+	RET
@@ -0,0 +1,3 @@
+# Included by include.asm
+part:
+	NOP
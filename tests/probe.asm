@@ -0,0 +1,13 @@
+# Routines for --probe: inner returns early with RET Z when C wraps
+0x150:
+start:
+	CALL outer
+	JP start
+outer:
+	CALL inner
+	CALL inner
+	RET
+inner:
+	INC C
+	RET Z
+	RET
@@ -0,0 +1,23 @@
+# Variables: the most accessed go to HRAM and are read with LDH, the one in a
+# wram section stays in WRAM. FACE is a label and C000 a number.
+0x150:
+start:
+	LD A,(hot)
+	LD (hot),A
+	LD A,(BED)
+	LD (FACE),A
+	LD A,(C000)
+	LD A,(big)
+	JP start
+.ramsection
+hot:
+.ds 1
+BED:
+.ds 1
+.endramsection
+.ramsection wram
+big:
+.ds 2
+.endramsection
+FACE:
+.data 0
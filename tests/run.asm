@@ -0,0 +1,25 @@
+# Routines for --run: A = B * C, and the sum of a table in memory
+0x150:
+start:
+	JP start
+mul8:
+	XOR A
+	INC C
+.loop:
+	DEC C
+	RET Z
+	ADD A,B
+	JR .loop
+sum:
+	LD HL,0C000
+	LD B,4
+	XOR A
+.next:
+	ADD A,(HL)
+	INC HL
+	DEC B
+	JR NZ,.next
+	LD (0C010),A
+	RET
+stuck:
+	HALT
@@ -0,0 +1,251 @@
+#!/bin/sh
+# Regression tests, run from the repository root: sh tests/run.sh
+# Builds the assembler and exits with 1 if any of the cases fail.
+cc -Wall -O2 -o tests/pgb-asm pgb-asm.c -lm || exit 1
+pgb=./tests/pgb-asm
+tmp=$(mktemp -d)
+fail=0
+
+# Reports a failed case
+failed() { echo "$1: $2"; fail=1; }
+
+# Prints n bytes of a file from adress (hex) as hex digits
+bytes() { od -An -tx1 -v -j $((0x$2)) -N $3 "$1" | tr -d ' \n'; }
+
+# Checks the bytes of a file from adress (hex): expect name file adress hex
+expect()
+{
+	got=$(bytes $2 $3 $((${#4} / 2)))
+	[ "$got" = "$4" ] || failed $1 "expected $4 at $3 of $2, got $got"
+}
+
+# Assembles tests/name.asm to $tmp/name.gb with options, and checks that the
+# bytes from adress (hex) are the expected ones: assemble name adress hex [opt...]
+assemble()
+{
+	name=$1 adress=$2 hex=$3
+	shift 3
+	if ! $pgb "$@" tests/$name.asm $tmp/$name.gb >$tmp/$name.log 2>&1; then
+		failed $name "failed to assemble"
+		cat $tmp/$name.log
+	else
+		expect $name $tmp/$name.gb $adress $hex
+	fi
+}
+
+# user-026: .if, .ifdef and .ifndef, with and without -D
+assemble cond 150 "3e010602c9"
+assemble cond 150 "3e010601c9" -D EXTRA
+
+# user-027: a variant with its own defines, built in the same run
+$pgb tests/cond.asm $tmp/cond.gb -V $tmp/cond_extra.gb:EXTRA >/dev/null 2>&1 || failed variants "failed to assemble"
+expect variants $tmp/cond.gb 150 "3e010602c9"
+expect variants $tmp/cond_extra.gb 150 "3e010601c9"
+
+# user-028: a line with too many operands is reported, and so is the next
+$pgb --check tests/operands.asm >$tmp/operands.log 2>&1
+grep -q '"line":5,.*Too many operands' $tmp/operands.log && grep -q '"line":6,' $tmp/operands.log \
+	|| failed operands "expected errors on line 5 and 6"
+
+# user-028: errors sorted by line, with one error: prefix
+$pgb tests/errors.asm $tmp/errors.gb 2>&1 | grep "^tests/errors.asm" >$tmp/errors.log
+printf '%s\n' "tests/errors.asm:4: error: Undefined label 'NOWHERE' referenced!" \
+	"tests/errors.asm:5: error: Syntax error near 'FOO'" | cmp -s - $tmp/errors.log \
+	|| failed errors "unexpected messages: $(cat $tmp/errors.log)"
+$pgb --check tests/errors.asm | grep -q '"message":"error' && failed errors "JSON message has a prefix"
+
+# user-029: --check prints nothing for a valid file, and the errors of stdin
+# as JSON
+[ -z "$($pgb --check tests/cond.asm 2>&1)" ] || failed check "output for a valid file"
+$pgb --check - <tests/errors.asm >$tmp/check.log
+st=$?
+[ $st = 3 ] || failed check "exit status $st for errors"
+[ "$(grep -c '^{"file":"-","line":[45],"severity":"error","message":".*"}$' $tmp/check.log)" = 2 ] \
+	|| failed check "unexpected JSON: $(cat $tmp/check.log)"
+
+# user-030: -MD -MP lists the included file, with an empty rule for it
+assemble include 150 "00c9" -I tests -MD -MP
+printf '%s\n' "$tmp/include.gb: \\" " tests/include.asm \\" " tests/part.asm" "" "tests/part.asm:" \
+	| cmp -s - $tmp/include.gb.d || failed depfile "unexpected rule: $(cat $tmp/include.gb.d)"
+
+# user-031: --watch assembles again when the source changes
+printf '0x150:\nstart:\n\tLD A,1\n' >$tmp/watch.asm
+$pgb --watch $tmp/watch.asm $tmp/watch.gb >$tmp/watch.log 2>&1 &
+watch=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do [ -f $tmp/watch.gb ] && break; sleep 0.2; done
+expect watch $tmp/watch.gb 150 "3e01"
+sleep 0.2
+printf '0x150:\nstart:\n\tLD A,2\n' >$tmp/watch.asm
+for i in 1 2 3 4 5 6 7 8 9 10; do [ "$(bytes $tmp/watch.gb 150 2)" = "3e02" ] && break; sleep 0.2; done
+expect watch $tmp/watch.gb 150 "3e02"
+kill $watch
+wait $watch 2>/dev/null
+
+# user-032: the server answers a request, and leaves files other than 
+# sockets alone
+if command -v python3 >/dev/null; then
+	$pgb --server $tmp/socket >/dev/null &
+	server=$!
+	for i in 1 2 3 4 5 6 7 8 9 10; do [ -S $tmp/socket ] && break; sleep 0.2; done
+	python3 - $tmp/socket >$tmp/server.log <<'END'
+import socket, struct, sys
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+req = b"symbol\0tests/cond.asm\0start\0"
+s.sendall(struct.pack(">I", len(req)) + req)
+head = s.recv(4, socket.MSG_WAITALL)
+sys.stdout.write(s.recv(struct.unpack(">I", head)[0], socket.MSG_WAITALL).decode())
+END
+	printf '0\nSTART = 0x150\n' | cmp -s - $tmp/server.log || failed server "unexpected response: $(cat $tmp/server.log)"
+	kill $server
+	wait $server 2>/dev/null
+else
+	echo "server: skipped, python3 is needed for a client"
+fi
+echo "not a socket" >$tmp/file
+$pgb --server $tmp/file >/dev/null && failed server "listening on a file that is not a socket"
+[ -f $tmp/file ] || failed server "removed a file that is not a socket"
+
+# user-033: the second build comes from the cache, and a change to the source
+# builds again
+cp tests/cond.asm $tmp/cache.asm
+$pgb --cache $tmp/cache $tmp/cache.asm $tmp/cache1.gb >/dev/null 2>&1
+$pgb --cache $tmp/cache $tmp/cache.asm $tmp/cache2.gb 2>&1 | grep -q "(cached)" || failed cache "not taken from the cache"
+cmp -s $tmp/cache1.gb $tmp/cache2.gb || failed cache "cached ROM differs"
+sed 's/LD A,1/LD A,5/' tests/cond.asm >$tmp/cache.asm
+$pgb --cache $tmp/cache $tmp/cache.asm $tmp/cache3.gb 2>&1 | grep -q "(cached)" && failed cache "changed source taken from the cache"
+expect cache $tmp/cache3.gb 150 "3e05"
+
+# user-034: the header and global checksums match the bytes of the ROM, 
+# --no-header leaves them alone
+assemble header 14d "3f1955"
+sums=$(od -An -tu1 -v $tmp/header.gb | awk '{ for(i = 1; i <= NF; i++) b[n++] = $i }
+	END { for(i = 308; i <= 332; i++) h = (h - b[i] - 1 + 512) % 256
+	      for(i = 0; i < n; i++) if(i != 334 && i != 335) g += b[i]
+	      printf "%02x%04x", h, g % 65536 }')
+expect header $tmp/header.gb 14d $sums
+assemble header 14d "000000" --no-header
+
+# user-035: --update writes only the changed byte, --ips writes a patch for it
+cp tests/cond.asm $tmp/update.asm
+$pgb --no-header $tmp/update.asm $tmp/update.gb >/dev/null 2>&1
+sed 's/LD A,1/LD A,5/' tests/cond.asm >$tmp/update.asm
+$pgb --no-header --update --ips $tmp/update.asm $tmp/update.gb 2>&1 | grep -q " 1 byte written" \
+	|| failed update "expected 1 byte written"
+expect update $tmp/update.gb 150 "3e05"
+expect update $tmp/update.gb.ips 0 "5041544348000151000105454f46"
+
+# user-036: source from stdin and ROM to stdout, messages to stderr
+$pgb tests/cond.asm $tmp/file.gb >/dev/null 2>&1
+$pgb - - <tests/cond.asm >$tmp/pipe.gb 2>/dev/null || failed pipe "failed to assemble"
+cmp -s $tmp/file.gb $tmp/pipe.gb || failed pipe "ROM on stdout differs"
+
+# user-037: builds that reuse the blocks of the arena give the same ROM, with 
+# more labels than fit in one block
+awk 'BEGIN { print "0x150:"; for(i = 0; i < 2000; i++) printf "label_%d:\n\tCALL label_%d\n", i, (i * 7) % 2000 }' \
+	>$tmp/arena.asm
+$pgb $tmp/arena.asm $tmp/arena.gb -V $tmp/arena_1.gb:A -V $tmp/arena_2.gb:B >/dev/null 2>&1 \
+	|| failed arena "failed to assemble"
+expect arena $tmp/arena.gb 150 "cd5001cd6501"
+expect arena $tmp/arena.gb 18bd "cdab18"
+cmp -s $tmp/arena.gb $tmp/arena_1.gb && cmp -s $tmp/arena.gb $tmp/arena_2.gb || failed arena "variants differ"
+
+# user-038: local labels named like directives, .table and .tablew
+assemble directives 150 "180018fe0002040600000001"
+
+# user-038: local labels belong to their scope, anonymous labels
+assemble locals 150 "18fe180218fe18fe1800c9"
+printf '0x150:\nfirst:\n.loop:\n\tNOP\nsecond:\n\tJR .loop\n' | $pgb --check - \
+	| grep -q '"line":6,.*Undefined local label' || failed locals "local label of another scope found"
+
+# user-039: a profile with label counts suggests moving the hot routines to
+# bank 0
+$pgb --profile tests/profile.txt tests/banks.asm $tmp/banks.gb >$tmp/profile.log 2>&1
+grep -q "A2: bank 1 -> bank 0 (300 executions, 2 bytes)" $tmp/profile.log \
+	&& grep -q "Estimated bank switches: 300 -> 0" $tmp/profile.log || failed profile "unexpected layout: $(cat $tmp/profile.log)"
+
+# user-040: calls that cross banks, as text and as JSON
+$pgb --callgraph --callgraph-json $tmp/callgraph.json tests/banks.asm $tmp/banks.gb >$tmp/callgraph.log 2>&1
+grep -q "call A2 (bank 1) at 0x8001, crosses banks, ~48 cycles" $tmp/callgraph.log \
+	|| failed callgraph "unexpected call graph: $(cat $tmp/callgraph.log)"
+grep -q '"to":"A2","kind":"call","bank":1,"site":16385,"cross_bank":false' $tmp/callgraph.json \
+	&& grep -q '"cross_bank":3,"trampoline":0,"cycles":144}$' $tmp/callgraph.json \
+	|| failed callgraph "unexpected JSON: $(cat $tmp/callgraph.json)"
+
+# user-041: --strip leaves out the library routine that is not reached, the
+# code after it moves up
+assemble strip 150 "cd5601c350013e023cc9c35a01" --strip
+grep -q "UNUSED (3 bytes)" $tmp/strip.log || failed strip "stripped routine not listed"
+
+# user-042: --dedup points the label of the copy to the first block
+assemble dedup 150 "215701115b01c90102030401020305" --dedup
+grep -q "SECOND -> FIRST (4 bytes)" $tmp/dedup.log || failed dedup "merged block not listed"
+
+# user-043: RLE and LZ data unpack to the original bytes with pgb-unpack.asm
+printf 'ABCABCABCABC\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0pgb' >$tmp/asset.bin
+unpacked="DE=0C01F,(C000)=41,(C00B)=43,(C00C)=0,(C01B)=0,(C01C)=70,(C01E)=62"
+$pgb -I $tmp --run "rle::$unpacked" --run "lz::$unpacked" tests/compress.asm $tmp/compress.gb \
+	>$tmp/compress.log 2>&1 || failed compress "unexpected bytes: $(grep -v "^Assembling\|^warning" $tmp/compress.log)"
+
+# user-044: variables in HRAM are accessed with LDH, the rest go to WRAM; 
+# hex-like names are labels if there are such labels
+assemble ram 150 "f080e080f081ea6201fa00c0fa00c0c35001"
+assemble ram 150 "f080e080fa00c0ea6301fa00c0fa01c0c35001" --hram 1
+
+# user-045: the locals of routines that are never active at once share WRAM
+assemble overlay 159 "ea00c0cd6401c9ea00c0c9ea01c0c9"
+grep -q "Local variables at 0xC000: 0x2 bytes, 0x3 without sharing." $tmp/overlay.log \
+	|| failed overlay "unexpected overlay: $(cat $tmp/overlay.log)"
+
+# user-046: .table of bytes and .tablew of words
+assemble table 150 "00597f5900a781a70000020004000600"
+
+# user-047: .jumptable dispatches in 48 cycles (72 with LD B,n and RET), 60
+# when the table crosses a page, on both paths of the carry. CYCLES is hex.
+$pgb --run "dispatch:A=2:B=0C,CYCLES=48" --run "crossing:A=0:B=0A,CYCLES=54" \
+	--run "crossing:A=2:B=0C,CYCLES=54" \
+	tests/jumptable.asm $tmp/jumptable.gb >$tmp/jumptable.log 2>&1 || failed jumptable "wrong target"
+[ "$(grep -c "Returned after 72 cycles" $tmp/jumptable.log)" = 1 ] \
+	&& [ "$(grep -c "Returned after 84 cycles" $tmp/jumptable.log)" = 2 ] \
+	|| failed jumptable "unexpected cycles: $(grep Returned $tmp/jumptable.log)"
+
+# user-048: --run checks registers, memory and cycles (144, 90 in hex), and 
+# exits with status 4 when a value is wrong or the routine does not return
+$pgb --run "mul8:B=3,C=4:A=0C,F=0C0,CYCLES=90" \
+	--run "sum:(C000)=1,(C001)=2,(C002)=3,(C003)=4:(C010)=0A,HL=0C004" \
+	tests/run.asm $tmp/run.gb >$tmp/run.log 2>&1 || failed run "unexpected result: $(cat $tmp/run.log)"
+grep -q "MUL8: Returned after 144 cycles, 20 instructions." $tmp/run.log || failed run "unexpected cycles"
+for spec in "mul8:B=3,C=4:A=0D" "mul8:B=3,C=4:CYCLES=8F" "stuck"; do
+	$pgb --run "$spec" tests/run.asm $tmp/run.gb >/dev/null 2>&1
+	st=$?
+	[ $st = 4 ] || failed run "exit status $st for $spec"
+done
+
+# user-049: port= probes write the ID on entry and before RET and RET Z, 
+# counters count the calls of each routine; the sidecar lists the IDs
+$pgb --probe port=0C000 --run "inner:C=0FF,(C001)=0:(C000)=3,(C001)=3" \
+	--run "inner:C=1,(C001)=0:(C000)=3,(C001)=3" --run "outer:C=1:(C000)=3,(C001)=2" \
+	tests/probe.asm $tmp/probe.gb >$tmp/probe.log 2>&1 || failed probe "unexpected IDs: $(cat $tmp/probe.log)"
+grep -v "^#" $tmp/probe.gb.probes >$tmp/probe.ids
+printf '%s\n' "01 START" "02 OUTER" "03 INNER" | cmp -s - $tmp/probe.ids \
+	|| failed probe "unexpected sidecar: $(cat $tmp/probe.gb.probes)"
+$pgb --probe counters --run "outer::(C000)=0,(C002)=1,(C004)=2" tests/probe.asm $tmp/probe.gb >$tmp/probe.log 2>&1 \
+	|| failed probe "unexpected counts: $(cat $tmp/probe.log)"
+
+# user-049: jr_range.asm assembles, but not with an exit probe before its 
+# inner RET
+assemble jr_range 157 "187b"
+$pgb --probe port=7F:f tests/jr_range.asm $tmp/out.gb >/dev/null 2>&1 && failed jr_range "out of range JR not reported"
+
+# user-050: .vramcopy routines copy their part of the bytes in the cycles 
+# they report, and restore SP after copying from the stack
+$pgb --run "copy::(8000)=1,(8032)=33,(8033)=0,SP=0FFFE,CYCLES=3FC" \
+	--run "copy_1::(8033)=34,(805F)=60,(8060)=0,SP=0FFFE,CYCLES=390" \
+	--run "safe::(9800)=1,(9807)=8,(9808)=0,CYCLES=0C4" \
+	tests/vramcopy.asm $tmp/vramcopy.gb >$tmp/vramcopy.log 2>&1 || failed vramcopy "unexpected copy: $(cat $tmp/vramcopy.log)"
+grep -q "COPY: 0x33 bytes to 0x8000 in 0x3FC of 0x400 cycles, from the stack" $tmp/vramcopy.log \
+	&& grep -q "Returned after 1020 cycles" $tmp/vramcopy.log || failed vramcopy "reported cycles differ from the run"
+
+rm -rf $tmp tests/pgb-asm
+[ $fail = 0 ] && echo "All tests passed."
+exit $fail
@@ -0,0 +1,18 @@
+# A library with a routine that is called, one that is not and one that the
+# called one runs on into
+0x150:
+start:
+	CALL used
+	JP start
+.library
+unused:
+	LD A,1
+	RET
+used:
+	LD A,2
+next:
+	INC A
+	RET
+.endlibrary
+end:
+	JP end
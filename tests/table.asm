@@ -0,0 +1,6 @@
+# A sine table of bytes and a table of words
+0x150:
+sine:
+.table 8, sin(i*2*pi/8)*7F
+words:
+.tablew 4, i*2
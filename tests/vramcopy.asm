@@ -0,0 +1,10 @@
+# A copy from the stack split over two VBlanks, and a short one with regs
+0x150:
+start:
+	JP start
+copy:
+.vramcopy tiles, 8000, 60, 400
+safe:
+.vramcopy tiles, 9800, 8, 400 regs
+tiles:
+.table 60, i+1